@@ -0,0 +1,1902 @@
+/*
+ * Copyright (c) 2010 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* For recursive mutexes */
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "mixoss.h"
+
+/* One ioctl from a trace file; records of the same (op, dev, ctrl) stream
+ * are chained through next in file order. */
+struct trace_record {
+    enum mixoss_op op;
+    int dev;
+    int ctrl;
+    int ret;
+    int err;
+    unsigned long long latency_us;
+    unsigned char *data;
+
+    int next;
+};
+
+struct trace_stream {
+    enum mixoss_op op;
+    int dev;
+    int ctrl;
+
+    int cur; /* -1 for an empty slot */
+};
+
+struct mixoss_replay {
+    struct trace_record *records;
+    int nb_records;
+    struct trace_stream *streams;
+    int nb_streams; /* size of the hash table, a power of 2 */
+    double scale;
+};
+
+const char *mixoss_op_names[MIXOSS_NB_OPS] = {
+    [MIXOSS_OP_NRMIX]      = "nrmix",
+    [MIXOSS_OP_MIXERINFO]  = "mixerinfo",
+    [MIXOSS_OP_EXTINFO]    = "extinfo",
+    [MIXOSS_OP_READ]       = "read",
+    [MIXOSS_OP_WRITE]      = "write",
+    [MIXOSS_OP_ENGINEINFO] = "engineinfo",
+};
+
+const size_t mixoss_op_arg_sizes[MIXOSS_NB_OPS] = {
+    [MIXOSS_OP_NRMIX]      = sizeof(int),
+    [MIXOSS_OP_MIXERINFO]  = sizeof(struct oss_mixerinfo),
+    [MIXOSS_OP_EXTINFO]    = sizeof(struct oss_mixext),
+    [MIXOSS_OP_READ]       = sizeof(struct oss_mixer_value),
+    [MIXOSS_OP_WRITE]      = sizeof(struct oss_mixer_value),
+    [MIXOSS_OP_ENGINEINFO] = sizeof(struct oss_audioinfo),
+};
+
+const char *mixoss_health_names[] = {
+    [MIXOSS_OK]       = "ok",
+    [MIXOSS_DEGRADED] = "degraded",
+    [MIXOSS_GONE]     = "gone",
+};
+
+static void lock_context(struct mixoss *);
+static void unlock_context(struct mixoss *);
+static void report(struct mixoss *, const char *, ...);
+static void update_op_stats(struct mixoss_op_stats *, int, unsigned long long);
+static void get_op_key(enum mixoss_op, const void *, int *, int *);
+static void record_ioctl(struct mixoss *, enum mixoss_op, const void *,
+                         int, int, unsigned long long, unsigned long long);
+static struct trace_stream *find_replay_stream(struct mixoss_replay *,
+                                               enum mixoss_op, int, int, int);
+static int load_replay(struct mixoss *, struct mixoss_replay *,
+                       const char *);
+static void free_replay(struct mixoss_replay *);
+static int replay_ioctl(struct mixoss_replay *, enum mixoss_op, void *);
+static int send_all(int, const char *, size_t);
+static int remote_ioctl(struct mixoss *, enum mixoss_op, void *);
+static int traced_ioctl(struct mixoss *, enum mixoss_op,
+                        struct mixoss_control *, unsigned long, void *);
+static void update_mixer_health(struct mixoss *, struct mixoss_mixer *,
+                                enum mixoss_op, struct mixoss_control *, int);
+static int mixer_ioctl(struct mixoss *, enum mixoss_op,
+                       struct mixoss_control *, unsigned long, void *);
+static int revalidate_control(struct mixoss *, struct mixoss_control *);
+static int control_ioctl(struct mixoss *, enum mixoss_op,
+                         struct mixoss_control *, unsigned long,
+                         struct oss_mixer_value *);
+static void update_value(struct mixoss *, struct mixoss_control *, int, int);
+static int read_control(struct mixoss *, struct mixoss_control *);
+static int write_control(struct mixoss *, struct mixoss_control *, int);
+static int level_to_percent(const struct mixoss_control *, int);
+static int percent_to_level(const struct mixoss_control *, int);
+static void queue_control_write(struct mixoss *, struct mixoss_control *, int);
+static int flush_control_writes(struct mixoss *);
+static int load_mixer(struct mixoss *, struct mixoss_mixer *);
+static void free_mixer(struct mixoss_mixer *);
+static void reload_mixer(struct mixoss *, struct mixoss_mixer *,
+                         const struct oss_mixerinfo *);
+static int init_mixers(struct mixoss *, int);
+static int load_mixer_infos(struct mixoss *);
+static int load_mixers(struct mixoss *);
+static void refresh_mixers(struct mixoss *);
+static void poll_mixer_values(struct mixoss *, struct mixoss_mixer *);
+static void free_mixers(struct mixoss *);
+static struct mixoss_mixer *find_mixer(struct mixoss *, const char *, size_t);
+static struct mixoss_control *find_control(struct mixoss_mixer *,
+                                           const char *);
+static struct mixoss_mixer *find_control_mixer(struct mixoss *, const char *,
+                                               const char **);
+static int map_shm(struct mixoss_shm_reader *);
+static int find_shm_control(const struct mixoss_shm_header *, const char *,
+                            struct mixoss_shm_control *);
+
+static void
+lock_context(struct mixoss *mx) {
+    pthread_mutex_lock(&mx->lock);
+    mx->lock_depth++;
+}
+
+static void
+unlock_context(struct mixoss *mx) {
+    char reports[MIXOSS_NB_REPORTS][MIXOSS_REPORT_SIZE];
+    void (*handler)(void *, const char *);
+    void *data;
+    int nb_reports;
+    int err;
+
+    /* Callers look at errno once the lock is released */
+    err = errno;
+
+    if (--mx->lock_depth > 0) {
+        pthread_mutex_unlock(&mx->lock);
+        errno = err;
+        return;
+    }
+
+    /* Messages are delivered once the context is unlocked, so that the
+     * handler may call the library again */
+    nb_reports = mx->nb_reports;
+    if (nb_reports > 0)
+        memcpy(reports, mx->reports, nb_reports * MIXOSS_REPORT_SIZE);
+    mx->nb_reports = 0;
+    handler = mx->error_handler;
+    data = mx->error_data;
+    pthread_mutex_unlock(&mx->lock);
+
+    for (int i = 0; i < nb_reports; i++) {
+        if (handler) {
+            handler(data, reports[i]);
+        } else {
+            fprintf(stderr, "%s\n", reports[i]);
+        }
+    }
+
+    errno = err;
+}
+
+static void
+report(struct mixoss *mx, const char *fmt, ...) {
+    va_list ap;
+
+    /* Called with the context locked, the oldest messages win */
+    if (mx->nb_reports == MIXOSS_NB_REPORTS)
+        return;
+
+    va_start(ap, fmt);
+    vsnprintf(mx->reports[mx->nb_reports++], MIXOSS_REPORT_SIZE, fmt, ap);
+    va_end(ap);
+}
+
+unsigned long long
+mixoss_time_us() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+update_op_stats(struct mixoss_op_stats *stats, int failed,
+                unsigned long long us) {
+    unsigned long long v;
+    int b;
+
+    stats->count++;
+    if (failed)
+        stats->errors++;
+
+    stats->total_us += us;
+    if (us > stats->max_us)
+        stats->max_us = us;
+
+    b = 0;
+    for (v = us; v && b < MIXOSS_NB_STAT_BUCKETS - 1; v >>= 1)
+        b++;
+    stats->buckets[b]++;
+}
+
+void
+mixoss_encode_hex(char *buf, const void *data, size_t size) {
+    static const char digits[] = "0123456789abcdef";
+    const unsigned char *bytes;
+
+    /* Trailing zero bytes are implied, which keeps the large info
+     * structures short. */
+    bytes = data;
+    while (size > 0 && bytes[size - 1] == 0)
+        size--;
+
+    if (size == 0)
+        *buf++ = '-';
+
+    for (size_t i = 0; i < size; i++) {
+        *buf++ = digits[bytes[i] >> 4];
+        *buf++ = digits[bytes[i] & 0xf];
+    }
+
+    *buf = '\0';
+}
+
+void
+mixoss_decode_hex(const char *hex, void *data, size_t size) {
+    unsigned char *bytes;
+    size_t len;
+
+    bytes = data;
+    memset(bytes, 0, size);
+
+    len = strspn(hex, "0123456789abcdef") / 2;
+    if (len > size)
+        len = size;
+
+    for (size_t i = 0; i < len; i++) {
+        unsigned int byte;
+
+        sscanf(hex + 2 * i, "%2x", &byte);
+        bytes[i] = byte;
+    }
+}
+
+void
+mixoss_runtime_path(char *buf, size_t size, const char *ext) {
+    const char *dir;
+
+    dir = getenv("XDG_RUNTIME_DIR");
+    if (dir && *dir) {
+        snprintf(buf, size, "%s/mixoss.%s", dir, ext);
+    } else {
+        snprintf(buf, size, "/tmp/mixoss-%lu.%s",
+                 (unsigned long)getuid(), ext);
+    }
+}
+
+void
+mixoss_set_cloexec(int fd) {
+    /* Children of the caller must not hold the mixer or the daemon */
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+static void
+get_op_key(enum mixoss_op op, const void *arg, int *pdev, int *pctrl) {
+    *pdev = -1;
+    *pctrl = -1;
+
+    switch (op) {
+        case MIXOSS_OP_NRMIX:
+            break;
+
+        case MIXOSS_OP_MIXERINFO:
+            *pdev = ((const struct oss_mixerinfo *)arg)->dev;
+            break;
+
+        case MIXOSS_OP_EXTINFO:
+            *pdev = ((const struct oss_mixext *)arg)->dev;
+            *pctrl = ((const struct oss_mixext *)arg)->ctrl;
+            break;
+
+        case MIXOSS_OP_READ:
+        case MIXOSS_OP_WRITE:
+            *pdev = ((const struct oss_mixer_value *)arg)->dev;
+            *pctrl = ((const struct oss_mixer_value *)arg)->ctrl;
+            break;
+
+        case MIXOSS_OP_ENGINEINFO:
+            *pdev = ((const struct oss_audioinfo *)arg)->dev;
+            break;
+
+        default:
+            break;
+    }
+}
+
+static void
+record_ioctl(struct mixoss *mx, enum mixoss_op op, const void *arg,
+             int ret, int err,
+             unsigned long long start, unsigned long long us) {
+    char hex[MIXOSS_HEX_ARG_SIZE];
+    int dev, ctrl;
+
+    get_op_key(op, arg, &dev, &ctrl);
+
+    mixoss_encode_hex(hex, arg, mixoss_op_arg_sizes[op]);
+    fprintf(mx->record_fp, "%llu %s %d %d %d %d %llu %s\n",
+            start - mx->record_start, mixoss_op_names[op],
+            dev, ctrl, ret, err, us, hex);
+}
+
+static struct trace_stream *
+find_replay_stream(struct mixoss_replay *replay,
+                   enum mixoss_op op, int dev, int ctrl, int create) {
+    unsigned int h;
+
+    h = ((unsigned int)op * 31 + (unsigned int)dev) * 1021
+      + (unsigned int)ctrl;
+
+    for (;;) {
+        struct trace_stream *stream;
+
+        stream = &replay->streams[h & (replay->nb_streams - 1)];
+
+        if (stream->cur == -1) {
+            if (!create)
+                return NULL;
+
+            stream->op = op;
+            stream->dev = dev;
+            stream->ctrl = ctrl;
+            return stream;
+        }
+
+        if (stream->op == op && stream->dev == dev && stream->ctrl == ctrl)
+            return stream;
+
+        h++;
+    }
+}
+
+static int
+load_replay(struct mixoss *mx, struct mixoss_replay *replay,
+            const char *path) {
+    char line[MIXOSS_HEX_ARG_SIZE + 256];
+    int *last;
+    int nb_allocated;
+    FILE *fp;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        report(mx, "cannot open %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    nb_allocated = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        struct trace_record *rec;
+        unsigned long long time;
+        char opname[16];
+        int n;
+
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+
+        if (replay->nb_records == nb_allocated) {
+            struct trace_record *records;
+
+            nb_allocated = nb_allocated ? nb_allocated * 2 : 256;
+            records = realloc(replay->records,
+                              nb_allocated * sizeof(struct trace_record));
+            if (!records) {
+                report(mx, "cannot allocate trace records: %s",
+                       strerror(errno));
+                goto error;
+            }
+            replay->records = records;
+        }
+
+        rec = &replay->records[replay->nb_records];
+
+        if (sscanf(line, "%llu %15s %d %d %d %d %llu %n",
+                   &time, opname, &rec->dev, &rec->ctrl,
+                   &rec->ret, &rec->err, &rec->latency_us, &n) < 7) {
+            line[strcspn(line, "\n")] = '\0';
+            report(mx, "%s: invalid trace record '%s'", path, line);
+            goto error;
+        }
+
+        for (rec->op = 0; rec->op < MIXOSS_NB_OPS; rec->op++) {
+            if (strcmp(opname, mixoss_op_names[rec->op]) == 0)
+                break;
+        }
+        if (rec->op == MIXOSS_NB_OPS) {
+            report(mx, "%s: unknown request '%s'", path, opname);
+            goto error;
+        }
+
+        rec->data = calloc(1, mixoss_op_arg_sizes[rec->op]);
+        if (!rec->data) {
+            report(mx, "cannot allocate trace data: %s", strerror(errno));
+            goto error;
+        }
+        replay->nb_records++;
+
+        mixoss_decode_hex(line + n, rec->data, mixoss_op_arg_sizes[rec->op]);
+    }
+
+    if (ferror(fp)) {
+        report(mx, "cannot read %s: %s", path, strerror(errno));
+        goto error;
+    }
+    fclose(fp);
+    fp = NULL;
+
+    /* There cannot be more streams than records; keep the hash table at
+     * most half full. */
+    replay->nb_streams = 16;
+    while (replay->nb_streams < 2 * replay->nb_records)
+        replay->nb_streams *= 2;
+
+    replay->streams = malloc(replay->nb_streams * sizeof(struct trace_stream));
+    last = malloc(replay->nb_streams * sizeof(int));
+    if (!replay->streams || !last) {
+        report(mx, "cannot allocate trace streams: %s", strerror(errno));
+        free(last);
+        goto error;
+    }
+
+    for (int i = 0; i < replay->nb_streams; i++)
+        replay->streams[i].cur = -1;
+
+    for (int r = 0; r < replay->nb_records; r++) {
+        struct trace_record *rec = &replay->records[r];
+        struct trace_stream *stream;
+        int s;
+
+        rec->next = -1;
+
+        stream = find_replay_stream(replay, rec->op, rec->dev, rec->ctrl, 1);
+        s = stream - replay->streams;
+        if (stream->cur == -1) {
+            stream->cur = r;
+        } else {
+            replay->records[last[s]].next = r;
+        }
+        last[s] = r;
+    }
+
+    free(last);
+    return 0;
+
+error:
+    if (fp)
+        fclose(fp);
+    free_replay(replay);
+    return -1;
+}
+
+static void
+free_replay(struct mixoss_replay *replay) {
+    for (int r = 0; r < replay->nb_records; r++)
+        free(replay->records[r].data);
+    free(replay->records);
+    replay->records = NULL;
+    replay->nb_records = 0;
+
+    free(replay->streams);
+    replay->streams = NULL;
+    replay->nb_streams = 0;
+}
+
+static int
+replay_ioctl(struct mixoss_replay *replay, enum mixoss_op op, void *arg) {
+    struct trace_stream *stream;
+    struct trace_record *rec;
+    int dev, ctrl;
+
+    get_op_key(op, arg, &dev, &ctrl);
+
+    stream = find_replay_stream(replay, op, dev, ctrl, 0);
+    if (!stream) {
+        /* The device was not used while recording */
+        errno = ENXIO;
+        return -1;
+    }
+
+    /* Each stream plays its records in order then sticks to the last one,
+     * so the replay does not depend on the exact interleaving of calls. */
+    rec = &replay->records[stream->cur];
+    if (rec->next != -1)
+        stream->cur = rec->next;
+
+    if (replay->scale > 0.0 && rec->latency_us > 0) {
+        unsigned long long us;
+        struct timespec ts;
+
+        us = rec->latency_us * replay->scale;
+        ts.tv_sec = us / 1000000;
+        ts.tv_nsec = (us % 1000000) * 1000;
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+            ;
+    }
+
+    if (rec->ret == -1) {
+        errno = rec->err;
+        return -1;
+    }
+
+    if (op != MIXOSS_OP_WRITE)
+        memcpy(arg, rec->data, mixoss_op_arg_sizes[op]);
+
+    return rec->ret;
+}
+
+static int
+send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n;
+
+        /* A daemon going away shows up as failing ioctls, not as a
+         * signal sent to the whole process */
+        n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int
+remote_ioctl(struct mixoss *mx, enum mixoss_op op, void *arg) {
+    char line[MIXOSS_LINE_SIZE];
+    char hex[MIXOSS_HEX_ARG_SIZE];
+    char *nl;
+    int ret, err;
+    int len;
+
+    mixoss_encode_hex(hex, arg, mixoss_op_arg_sizes[op]);
+    len = snprintf(line, sizeof(line), "ioctl %s %s\n",
+                   mixoss_op_names[op], hex);
+    if (send_all(mx->remote_fd, line, len) == -1)
+        return -1;
+
+    /* Nothing is subscribed, so the next line is the reply */
+    while (!(nl = memchr(mx->remote_in, '\n', mx->remote_in_len))) {
+        ssize_t n;
+
+        if (mx->remote_in_len == sizeof(mx->remote_in)) {
+            errno = EIO;
+            return -1;
+        }
+
+        n = read(mx->remote_fd, mx->remote_in + mx->remote_in_len,
+                 sizeof(mx->remote_in) - mx->remote_in_len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n == 0)
+                errno = ECONNRESET;
+            return -1;
+        }
+        mx->remote_in_len += n;
+    }
+    *nl = '\0';
+
+    len = 0;
+    if (sscanf(mx->remote_in, "ioctl %d %d %n", &ret, &err, &len) < 2
+     || len == 0) {
+        errno = EIO;
+        ret = -1;
+    } else if (ret == -1) {
+        errno = err;
+    } else if (op != MIXOSS_OP_WRITE) {
+        mixoss_decode_hex(mx->remote_in + len, arg, mixoss_op_arg_sizes[op]);
+    }
+
+    mx->remote_in_len -= nl + 1 - mx->remote_in;
+    memmove(mx->remote_in, nl + 1, mx->remote_in_len);
+
+    return ret;
+}
+
+static int
+traced_ioctl(struct mixoss *mx, enum mixoss_op op,
+             struct mixoss_control *ctrl, unsigned long req, void *arg) {
+    unsigned long long start, us;
+    int ret, err;
+
+    if (!mx->stats_enabled && !mx->record_fp && !mx->replay
+     && mx->remote_fd < 0) {
+        return ioctl(mx->fd, req, arg);
+    }
+
+    start = mixoss_time_us();
+    if (mx->replay) {
+        ret = replay_ioctl(mx->replay, op, arg);
+    } else if (mx->remote_fd >= 0) {
+        ret = remote_ioctl(mx, op, arg);
+    } else {
+        ret = ioctl(mx->fd, req, arg);
+    }
+    err = errno;
+    us = mixoss_time_us() - start;
+
+    if (mx->record_fp)
+        record_ioctl(mx, op, arg, ret, err, start, us);
+
+    if (!mx->stats_enabled) {
+        errno = err;
+        return ret;
+    }
+
+    update_op_stats(&mx->op_stats[op], ret == -1, us);
+
+    if (ctrl) {
+        if (!ctrl->stats) {
+            ctrl->stats = calloc(MIXOSS_NB_OPS,
+                                 sizeof(struct mixoss_op_stats));
+        }
+        if (ctrl->stats)
+            update_op_stats(&ctrl->stats[op], ret == -1, us);
+    }
+
+    errno = err;
+    return ret;
+}
+
+static void
+update_mixer_health(struct mixoss *mx, struct mixoss_mixer *mixer,
+                    enum mixoss_op op, struct mixoss_control *ctrl, int err) {
+    enum mixoss_health health;
+
+    /* EIDRM comes from a live device and is handled by the caller */
+    if (!err || err == EIDRM) {
+        if (mixer->nb_failures > 0)
+            report(mx, "mixer '%s' is back", mixer->info.name);
+
+        mixer->health = MIXOSS_OK;
+        mixer->nb_failures = 0;
+        mixer->backoff = 0;
+        return;
+    }
+
+    mixer->nb_failures++;
+
+    health = MIXOSS_DEGRADED;
+    if (err == ENXIO || err == ENODEV
+     || mixer->nb_failures >= mx->max_failures) {
+        health = MIXOSS_GONE;
+    }
+
+    if (health == MIXOSS_GONE) {
+        mixer->backoff = mx->max_backoff;
+    } else if (mixer->backoff == 0) {
+        mixer->backoff = mx->retry_interval;
+    } else if (mixer->backoff < mx->max_backoff) {
+        mixer->backoff *= 2;
+        if (mixer->backoff > mx->max_backoff)
+            mixer->backoff = mx->max_backoff;
+    }
+
+    mixer->retry_at = mixoss_time_us() + mixer->backoff * 1000ULL;
+    mixer->health = health;
+
+    /* Callers are expected to aggregate identical messages */
+    report(mx, "mixer '%s' %s: %s %s: %s",
+           mixer->info.name, mixoss_health_names[health],
+           mixoss_op_names[op], ctrl ? ctrl->info.id : "info",
+           strerror(err));
+}
+
+static int
+mixer_ioctl(struct mixoss *mx, enum mixoss_op op,
+            struct mixoss_control *ctrl, unsigned long req, void *arg) {
+    struct mixoss_mixer *mixer;
+    int dev, ret;
+
+    dev = -1;
+    if (op == MIXOSS_OP_MIXERINFO) {
+        dev = ((struct oss_mixerinfo *)arg)->dev;
+    } else if (ctrl && op != MIXOSS_OP_ENGINEINFO) {
+        dev = ctrl->info.dev;
+    }
+
+    if (dev < 0 || dev >= mx->nb_mixers)
+        return traced_ioctl(mx, op, ctrl, req, arg);
+
+    mixer = &mx->mixers[dev];
+
+    /* While a mixer backs off, requests fail without reaching the
+     * driver, so that a dead device does not cost anything. */
+    if (mixer->health != MIXOSS_OK && mixoss_time_us() < mixer->retry_at) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    ret = traced_ioctl(mx, op, ctrl, req, arg);
+    if (ret == -1) {
+        int err = errno;
+
+        update_mixer_health(mx, mixer, op, ctrl, err);
+        errno = err;
+    } else if (mixer->health != MIXOSS_OK) {
+        update_mixer_health(mx, mixer, op, ctrl, 0);
+    }
+
+    return ret;
+}
+
+static int
+revalidate_control(struct mixoss *mx, struct mixoss_control *ctrl) {
+    struct mixoss_mixer *mixer;
+    struct oss_mixext ext;
+
+    mixer = &mx->mixers[ctrl->info.dev];
+
+    memset(&ext, 0, sizeof(ext));
+    ext.dev = ctrl->info.dev;
+    ext.ctrl = ctrl->info.ctrl;
+
+    if (mixer_ioctl(mx, MIXOSS_OP_EXTINFO, ctrl,
+                    SNDCTL_MIX_EXTINFO, &ext) == -1
+     || ext.type != ctrl->info.type
+     || ext.minvalue != ctrl->info.minvalue
+     || ext.maxvalue != ctrl->info.maxvalue
+     || ext.parent != ctrl->info.parent
+     || strcmp(ext.id, ctrl->info.id) != 0) {
+        /* The control is gone or is now something else; other controls
+         * probably moved too, so the whole mixer is reloaded at the next
+         * refresh, when no control is being used. */
+        if (!mixer->needs_reload) {
+            report(mx, "controls of mixer '%s' changed, reloading",
+                   mixer->info.name);
+        }
+        mixer->needs_reload = 1;
+        return -1;
+    }
+
+    ctrl->info = ext;
+    return 0;
+}
+
+static int
+control_ioctl(struct mixoss *mx, enum mixoss_op op,
+              struct mixoss_control *ctrl, unsigned long req,
+              struct oss_mixer_value *val) {
+    val->dev = ctrl->info.dev;
+    val->ctrl = ctrl->info.ctrl;
+    val->timestamp = ctrl->info.timestamp;
+
+    if (mixer_ioctl(mx, op, ctrl, req, val) == 0)
+        return 0;
+
+    /* EIDRM means that the timestamp is outdated: the driver changed its
+     * controls since they were enumerated. */
+    if (errno != EIDRM)
+        return -1;
+
+    if (revalidate_control(mx, ctrl) == -1) {
+        errno = EIDRM;
+        return -1;
+    }
+
+    val->timestamp = ctrl->info.timestamp;
+    return mixer_ioctl(mx, op, ctrl, req, val);
+}
+
+static void
+update_value(struct mixoss *mx, struct mixoss_control *ctrl, int value,
+             int written) {
+    int old_value;
+    int known;
+
+    known = ctrl->has_value;
+    ctrl->has_value = 1;
+    if (ctrl->value == value)
+        return;
+
+    old_value = ctrl->value;
+    ctrl->changed = 1;
+    ctrl->value = value;
+
+    /* The first value of a control, e.g. after a reload, is not a
+     * change */
+    if (known && mx->change_handler)
+        mx->change_handler(mx->change_data, ctrl, old_value, written);
+}
+
+static int
+read_control(struct mixoss *mx, struct mixoss_control *ctrl) {
+    struct oss_mixer_value val;
+
+    memset(&val, 0, sizeof(val));
+    val.value = -1;
+
+    /* Failures are reported through the mixer health */
+    if (control_ioctl(mx, MIXOSS_OP_READ, ctrl, SNDCTL_MIX_READ, &val) == -1)
+        return -1;
+
+    update_value(mx, ctrl, val.value, 0);
+    return 0;
+}
+
+static int
+write_control(struct mixoss *mx, struct mixoss_control *ctrl, int value) {
+    struct oss_mixer_value val;
+
+    memset(&val, 0, sizeof(val));
+    val.value = value;
+
+    if (control_ioctl(mx, MIXOSS_OP_WRITE, ctrl,
+                      SNDCTL_MIX_WRITE, &val) == -1) {
+        return -1;
+    }
+
+    update_value(mx, ctrl, value, 1);
+    return 0;
+}
+
+static int
+level_to_percent(const struct mixoss_control *ctrl, int level) {
+    int range;
+
+    range = ctrl->info.maxvalue - ctrl->info.minvalue;
+    if (range <= 0)
+        return 0;
+
+    return ((level - ctrl->info.minvalue) * 100 + range / 2) / range;
+}
+
+static int
+percent_to_level(const struct mixoss_control *ctrl, int percent) {
+    int range;
+
+    range = ctrl->info.maxvalue - ctrl->info.minvalue;
+
+    return ctrl->info.minvalue + (percent * range + 50) / 100;
+}
+
+int
+mixoss_decode_value(const struct mixoss_control *ctrl, int value,
+                    int *pleft, int *pright) {
+    switch (ctrl->info.type) {
+        case MIXT_STEREOSLIDER:
+            *pleft = level_to_percent(ctrl, value & 0xff);
+            *pright = level_to_percent(ctrl, (value >> 8) & 0xff);
+            return 2;
+
+        case MIXT_STEREOSLIDER16:
+            *pleft = level_to_percent(ctrl, value & 0xffff);
+            *pright = level_to_percent(ctrl, (value >> 16) & 0xffff);
+            return 2;
+
+        case MIXT_MONOSLIDER:
+            *pleft = level_to_percent(ctrl, value & 0xff);
+            *pright = *pleft;
+            return 1;
+
+        case MIXT_MONOSLIDER16:
+            *pleft = level_to_percent(ctrl, value & 0xffff);
+            *pright = *pleft;
+            return 1;
+
+        case MIXT_SLIDER:
+            *pleft = level_to_percent(ctrl, value);
+            *pright = *pleft;
+            return 1;
+
+        case MIXT_ONOFF:
+        case MIXT_MUTE:
+        case MIXT_ENUM:
+        case MIXT_VALUE:
+        case MIXT_HEXVALUE:
+            /* No scale, the raw value is used */
+            *pleft = value;
+            *pright = value;
+            return 1;
+
+        default:
+            return 0;
+    }
+}
+
+int
+mixoss_encode_value(const struct mixoss_control *ctrl, int left, int right) {
+    switch (ctrl->info.type) {
+        case MIXT_STEREOSLIDER:
+            return percent_to_level(ctrl, left)
+                 | (percent_to_level(ctrl, right) << 8);
+
+        case MIXT_STEREOSLIDER16:
+            return percent_to_level(ctrl, left)
+                 | (percent_to_level(ctrl, right) << 16);
+
+        case MIXT_MONOSLIDER:
+        case MIXT_MONOSLIDER16:
+        case MIXT_SLIDER:
+            return percent_to_level(ctrl, left);
+
+        default:
+            return left;
+    }
+}
+
+int
+mixoss_is_value_control(const struct mixoss_control *ctrl) {
+    int left, right;
+
+    return (ctrl->info.flags & MIXF_READABLE)
+        && mixoss_decode_value(ctrl, 0, &left, &right) > 0;
+}
+
+int
+mixoss_parse_levels(const char *str, int *pleft, int *pright) {
+    char *end;
+    long v;
+
+    v = strtol(str, &end, 10);
+    if (end == str || (*end != '\0' && *end != ','))
+        return -1;
+    *pleft = v;
+    *pright = v;
+
+    if (*end == '\0')
+        return 1;
+
+    str = end + 1;
+    v = strtol(str, &end, 10);
+    if (end == str || *end != '\0')
+        return -1;
+    *pright = v;
+
+    return 2;
+}
+
+int
+mixoss_parse_value(const struct mixoss_control *ctrl, const char *str,
+                   int *pleft, int *pright) {
+    int nb_channels;
+    int nb_values;
+
+    nb_channels = mixoss_decode_value(ctrl, 0, pleft, pright);
+
+    nb_values = mixoss_parse_levels(str, pleft, pright);
+    if (nb_values == -1 || nb_values > nb_channels)
+        return -1;
+
+    /* Sliders take percents, the other types their raw value */
+    if (ctrl->info.type != MIXT_ONOFF
+     && ctrl->info.type != MIXT_MUTE
+     && ctrl->info.type != MIXT_ENUM
+     && ctrl->info.type != MIXT_VALUE
+     && ctrl->info.type != MIXT_HEXVALUE
+     && (*pleft < 0 || *pleft > 100 || *pright < 0 || *pright > 100)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+mixoss_format_value(const struct mixoss_control *ctrl,
+                    char *buf, size_t size) {
+    int left, right;
+
+    if (mixoss_decode_value(ctrl, ctrl->value, &left, &right) == 2) {
+        snprintf(buf, size, "%d,%d", left, right);
+    } else {
+        snprintf(buf, size, "%d", left);
+    }
+}
+
+void
+mixoss_format_name(const struct mixoss_control *ctrl,
+                   char *buf, size_t size) {
+    if (ctrl->ambiguous) {
+        snprintf(buf, size, "%d:#%d", ctrl->info.dev, ctrl->info.ctrl);
+    } else {
+        snprintf(buf, size, "%d:%s", ctrl->info.dev, ctrl->info.id);
+    }
+}
+
+static void
+queue_control_write(struct mixoss *mx, struct mixoss_control *ctrl,
+                    int value) {
+    struct mixoss_mixer *mixer;
+
+    mixer = &mx->mixers[ctrl->info.dev];
+
+    if (!ctrl->pending) {
+        ctrl->pending = 1;
+        ctrl->pending_next = mixer->pending_controls;
+        mixer->pending_controls = ctrl;
+    }
+
+    ctrl->pending_value = value;
+}
+
+static int
+flush_control_writes(struct mixoss *mx) {
+    int nb_errors;
+
+    /* Writes are coalesced per control and issued device by device */
+    nb_errors = 0;
+    for (int m = 0; m < mx->nb_mixers; m++) {
+        struct mixoss_mixer *mixer = &mx->mixers[m];
+        struct mixoss_control *ctrl;
+
+        while ((ctrl = mixer->pending_controls)) {
+            mixer->pending_controls = ctrl->pending_next;
+            ctrl->pending_next = NULL;
+            ctrl->pending = 0;
+
+            ctrl->write_error = 0;
+            if (write_control(mx, ctrl, ctrl->pending_value) == -1) {
+                ctrl->write_error = errno;
+                nb_errors++;
+            }
+        }
+    }
+
+    return nb_errors;
+}
+
+static int
+load_mixer(struct mixoss *mx, struct mixoss_mixer *mixer) {
+    mixer->controls = NULL;
+    mixer->nb_controls = 0;
+    mixer->generation++;
+    mixer->values_counter = -1;
+    mx->reloaded = 1;
+
+    /* A disabled mixer (e.g. disconnected USB device) is kept without any
+     * control until it shows up again. */
+    if (!mixer->info.enabled || mixer->info.nrext <= 0)
+        return 0;
+
+    mixer->controls = calloc(mixer->info.nrext,
+                             sizeof(struct mixoss_control));
+    if (!mixer->controls)
+        return -1;
+    mixer->nb_controls = mixer->info.nrext;
+
+    for (int e = 0; e < mixer->nb_controls; e++) {
+        struct mixoss_control *ctrl = &mixer->controls[e];
+
+        ctrl->info.dev = mixer->info.dev;
+        ctrl->info.ctrl = e;
+
+        errno = 0;
+        if (mixer_ioctl(mx, MIXOSS_OP_EXTINFO, ctrl,
+                        SNDCTL_MIX_EXTINFO, &ctrl->info) == -1) {
+            int err = errno;
+
+            free_mixer(mixer);
+            errno = err;
+            return -1;
+        }
+
+        if (sscanf(ctrl->info.id, "@pcm%d", &ctrl->vmix_dev) == 1)
+            ctrl->is_vmix = 1;
+    }
+
+    /* Drivers may reuse an id within a mixer, those controls are named
+     * by their index instead */
+    for (int e = 0; e < mixer->nb_controls; e++) {
+        for (int o = e + 1; o < mixer->nb_controls; o++) {
+            if (strcmp(mixer->controls[e].info.id,
+                       mixer->controls[o].info.id) == 0) {
+                mixer->controls[e].ambiguous = 1;
+                mixer->controls[o].ambiguous = 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void
+free_mixer(struct mixoss_mixer *mixer) {
+    if (mixer->controls) {
+        for (int c = 0; c < mixer->nb_controls; c++)
+            free(mixer->controls[c].stats);
+    }
+    free(mixer->controls);
+
+    mixer->controls = NULL;
+    mixer->nb_controls = 0;
+    mixer->pending_controls = NULL;
+}
+
+static void
+reload_mixer(struct mixoss *mx, struct mixoss_mixer *mixer,
+             const struct oss_mixerinfo *info) {
+    free_mixer(mixer);
+    mixer->info = *info;
+    mixer->needs_reload = 0;
+
+    /* Retried by the next refresh, at the pace of the mixer backoff, so
+     * that the mixer is not left enabled without any control */
+    if (load_mixer(mx, mixer) == -1) {
+        report(mx, "cannot load controls of mixer '%s': %s",
+               mixer->info.name, strerror(errno));
+        mixer->needs_reload = 1;
+    }
+}
+
+static int
+init_mixers(struct mixoss *mx, int nb) {
+    struct mixoss_mixer *nmixers;
+
+    nmixers = realloc(mx->mixers, nb * sizeof(struct mixoss_mixer));
+    if (!nmixers)
+        return -1;
+
+    /* New mixers start out disabled, without any control */
+    if (nb > mx->nb_mixers) {
+        memset(&nmixers[mx->nb_mixers], 0,
+               (nb - mx->nb_mixers) * sizeof(struct mixoss_mixer));
+    }
+    for (int m = mx->nb_mixers; m < nb; m++)
+        nmixers[m].info.dev = m;
+
+    mx->mixers = nmixers;
+    mx->nb_mixers = nb;
+    return 0;
+}
+
+static int
+load_mixer_infos(struct mixoss *mx) {
+    int nb;
+
+    if (mixer_ioctl(mx, MIXOSS_OP_NRMIX, NULL, SNDCTL_MIX_NRMIX, &nb) == -1) {
+        report(mx, "cannot get number of mixers: %s", strerror(errno));
+        return -1;
+    }
+    if (!nb) {
+        report(mx, "no mixer found");
+        return -1;
+    }
+
+    if (init_mixers(mx, nb) == -1) {
+        report(mx, "cannot allocate mixer structures: %s", strerror(errno));
+        return -1;
+    }
+
+    for (int m = 0; m < mx->nb_mixers; m++) {
+        struct mixoss_mixer *mixer = &mx->mixers[m];
+
+        errno = 0;
+        if (mixer_ioctl(mx, MIXOSS_OP_MIXERINFO, NULL,
+                        SNDCTL_MIXERINFO, &mixer->info) == -1) {
+            report(mx, "cannot get mixer info: %s", strerror(errno));
+            free_mixers(mx);
+            return -1;
+        }
+
+        if (!mixer->info.enabled)
+            report(mx, "found a disabled device: '%s'", mixer->info.name);
+    }
+
+    return 0;
+}
+
+static int
+load_mixers(struct mixoss *mx) {
+    if (load_mixer_infos(mx) == -1)
+        return -1;
+
+    for (int m = 0; m < mx->nb_mixers; m++) {
+        if (load_mixer(mx, &mx->mixers[m]) == -1) {
+            report(mx, "cannot load mixer controls: %s", strerror(errno));
+            free_mixers(mx);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void
+refresh_mixers(struct mixoss *mx) {
+    struct oss_mixerinfo info;
+    int nb;
+
+    if (mixer_ioctl(mx, MIXOSS_OP_NRMIX, NULL, SNDCTL_MIX_NRMIX, &nb) == -1) {
+        report(mx, "cannot get number of mixers: %s", strerror(errno));
+        return;
+    }
+
+    /* New mixers get loaded below like any device coming back */
+    if (nb > mx->nb_mixers && init_mixers(mx, nb) == -1) {
+        report(mx, "cannot allocate mixer structures: %s", strerror(errno));
+        return;
+    }
+
+    /* Mixer numbers are never reused, a mixer which went away is only
+     * disabled so that indexes stay valid. */
+    for (int m = nb; m < mx->nb_mixers; m++) {
+        struct mixoss_mixer *mixer = &mx->mixers[m];
+
+        if (mixer->info.enabled) {
+            info = mixer->info;
+            info.enabled = 0;
+            reload_mixer(mx, mixer, &info);
+        }
+    }
+
+    for (int m = 0; m < nb && m < mx->nb_mixers; m++) {
+        struct mixoss_mixer *mixer = &mx->mixers[m];
+
+        memset(&info, 0, sizeof(info));
+        info.dev = m;
+
+        /* Failures and backoff are handled by the mixer health */
+        if (mixer_ioctl(mx, MIXOSS_OP_MIXERINFO, NULL,
+                        SNDCTL_MIXERINFO, &info) == -1) {
+            continue;
+        }
+
+        if (info.enabled != mixer->info.enabled
+         || info.nrext != mixer->info.nrext
+         || mixer->needs_reload) {
+            reload_mixer(mx, mixer, &info);
+        } else {
+            mixer->info = info;
+        }
+
+        /* A disabled mixer is only probed from time to time to see if it
+         * came back. */
+        if (!mixer->info.enabled) {
+            mixer->health = MIXOSS_GONE;
+            mixer->retry_at = mixoss_time_us() + mx->max_backoff * 1000ULL;
+        }
+    }
+}
+
+static void
+poll_mixer_values(struct mixoss *mx, struct mixoss_mixer *mixer) {
+    /* The driver bumps modify_counter whenever a value changes, so the
+     * controls are only read again when it moved. */
+    if (mixer->values_counter == mixer->info.modify_counter)
+        return;
+    mixer->values_counter = mixer->info.modify_counter;
+
+    for (int c = 0; c < mixer->nb_controls; c++) {
+        struct mixoss_control *ctrl = &mixer->controls[c];
+
+        if (!ctrl->no_poll && mixoss_is_value_control(ctrl))
+            read_control(mx, ctrl);
+    }
+}
+
+static void
+free_mixers(struct mixoss *mx) {
+    for (int m = 0; m < mx->nb_mixers; m++)
+        free_mixer(&mx->mixers[m]);
+
+    free(mx->mixers);
+    mx->mixers = NULL;
+    mx->nb_mixers = 0;
+}
+
+static struct mixoss_mixer *
+find_mixer(struct mixoss *mx, const char *name, size_t len) {
+    char *end;
+    long m;
+
+    m = strtol(name, &end, 10);
+    if (len > 0 && end == name + len) {
+        if (m < 0 || m >= mx->nb_mixers)
+            return NULL;
+        return &mx->mixers[m];
+    }
+
+    for (int i = 0; i < mx->nb_mixers; i++) {
+        struct oss_mixerinfo *info = &mx->mixers[i].info;
+
+        if ((strlen(info->name) == len && !strncmp(info->name, name, len))
+         || (strlen(info->id) == len && !strncmp(info->id, name, len))) {
+            return &mx->mixers[i];
+        }
+    }
+
+    return NULL;
+}
+
+static struct mixoss_control *
+find_control(struct mixoss_mixer *mixer, const char *id) {
+    struct mixoss_control *found;
+    char *end;
+    long c;
+
+    /* #index, as given by mixoss_format_name() for ambiguous ids */
+    if (id[0] == '#') {
+        c = strtol(id + 1, &end, 10);
+        if (end == id + 1 || *end != '\0' || c < 0
+         || c >= mixer->nb_controls) {
+            errno = ENOENT;
+            return NULL;
+        }
+        return &mixer->controls[c];
+    }
+
+    /* A name matching several controls is refused rather than resolved
+     * to whichever comes first */
+    found = NULL;
+    for (c = 0; c < mixer->nb_controls; c++) {
+        struct mixoss_control *ctrl = &mixer->controls[c];
+
+        if (strcmp(ctrl->info.id, id) == 0
+         || strcmp(ctrl->info.extname, id) == 0) {
+            if (found && found != ctrl) {
+                errno = EEXIST;
+                return NULL;
+            }
+            found = ctrl;
+        }
+    }
+
+    if (!found)
+        errno = ENOENT;
+    return found;
+}
+
+static struct mixoss_mixer *
+find_control_mixer(struct mixoss *mx, const char *name, const char **pid) {
+    const char *sep;
+
+    /* [mixer:]control, the mixer being an index, a name or an id */
+    sep = strchr(name, ':');
+    if (!sep) {
+        *pid = name;
+        return mx->nb_mixers > 0 ? &mx->mixers[0] : NULL;
+    }
+
+    *pid = sep + 1;
+    return find_mixer(mx, name, sep - name);
+}
+
+static int
+map_shm(struct mixoss_shm_reader *reader) {
+    const struct mixoss_shm_header *hdr;
+    struct stat st;
+    void *addr;
+    int fd;
+
+    fd = open(reader->path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(*hdr)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        return -1;
+
+    hdr = addr;
+    if (hdr->magic != MIXOSS_SHM_MAGIC || hdr->version != MIXOSS_SHM_VERSION
+     || st.st_size < (off_t)(sizeof(*hdr) + hdr->capacity
+                                          * sizeof(*hdr->controls))) {
+        munmap(addr, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    reader->hdr = hdr;
+    reader->size = st.st_size;
+    return 0;
+}
+
+static int
+find_shm_control(const struct mixoss_shm_header *hdr, const char *name,
+                 struct mixoss_shm_control *sctrl) {
+    const char *sep, *id;
+    size_t len;
+    long dev, index;
+    int found;
+
+    /* [dev:]control, the mixer being an index, the control an id or
+     * #index as for mixoss_lookup(). Mixer names are not published, one
+     * given here must not silently stand for the first mixer. */
+    sep = strchr(name, ':');
+    if (sep) {
+        len = sep - name;
+        if (len == 0 || strspn(name, "0123456789") != len) {
+            errno = ENOENT;
+            return -1;
+        }
+        dev = strtol(name, NULL, 10);
+        id = sep + 1;
+    } else {
+        dev = 0;
+        id = name;
+    }
+
+    index = -1;
+    if (id[0] == '#') {
+        len = strlen(id + 1);
+        if (len == 0 || strspn(id + 1, "0123456789") != len) {
+            errno = ENOENT;
+            return -1;
+        }
+        index = strtol(id + 1, NULL, 10);
+    }
+
+    found = 0;
+    for (unsigned int i = 0; i < hdr->nb_controls && i < hdr->capacity; i++) {
+        const struct mixoss_shm_control *c = &hdr->controls[i];
+
+        if (c->dev != dev)
+            continue;
+
+        if (index >= 0) {
+            if (c->ctrl == index) {
+                *sctrl = *c;
+                return 0;
+            }
+        } else if (strncmp(c->id, id, sizeof(c->id)) == 0
+                || strncmp(c->extname, id, sizeof(c->extname)) == 0) {
+            if (found++) {
+                errno = EEXIST;
+                return -1;
+            }
+            *sctrl = *c;
+        }
+    }
+
+    if (!found) {
+        errno = ENOENT;
+        return -1;
+    }
+    return 0;
+}
+
+struct mixoss *
+mixoss_new() {
+    pthread_mutexattr_t attr;
+    struct mixoss *mx;
+    int ret;
+
+    mx = calloc(1, sizeof(struct mixoss));
+    if (!mx)
+        return NULL;
+
+    /* Recursive, so that a caller holding mixoss_lock() may look a
+     * control up and use it without anyone reloading it meanwhile */
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    ret = pthread_mutex_init(&mx->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (ret != 0) {
+        free(mx);
+        return NULL;
+    }
+
+    mx->fd = -1;
+    mx->remote_fd = -1;
+    mx->retry_interval = 250;
+    mx->max_backoff = 4000;
+    mx->max_failures = 4;
+
+    return mx;
+}
+
+void
+mixoss_free(struct mixoss *mx) {
+    if (!mx)
+        return;
+
+    free_mixers(mx);
+
+    if (mx->record_fp)
+        fclose(mx->record_fp);
+
+    if (mx->replay) {
+        free_replay(mx->replay);
+        free(mx->replay);
+    }
+
+    if (mx->fd >= 0)
+        close(mx->fd);
+    if (mx->remote_fd >= 0)
+        close(mx->remote_fd);
+
+    pthread_mutex_destroy(&mx->lock);
+    free(mx);
+}
+
+void
+mixoss_lock(struct mixoss *mx) {
+    lock_context(mx);
+}
+
+void
+mixoss_unlock(struct mixoss *mx) {
+    unlock_context(mx);
+}
+
+void
+mixoss_set_error_handler(struct mixoss *mx,
+                         void (*handler)(void *, const char *), void *data) {
+    lock_context(mx);
+    mx->error_handler = handler;
+    mx->error_data = data;
+    unlock_context(mx);
+}
+
+void
+mixoss_set_change_handler(struct mixoss *mx,
+                          void (*handler)(void *,
+                                          const struct mixoss_control *,
+                                          int, int),
+                          void *data) {
+    lock_context(mx);
+    mx->change_handler = handler;
+    mx->change_data = data;
+    unlock_context(mx);
+}
+
+int
+mixoss_open(struct mixoss *mx, const char *path) {
+    int fd;
+
+    fd = open(path, O_RDWR);
+    if (fd == -1)
+        return -1;
+    mixoss_set_cloexec(fd);
+
+    lock_context(mx);
+    mx->fd = fd;
+    unlock_context(mx);
+    return 0;
+}
+
+int
+mixoss_open_replay(struct mixoss *mx, const char *path, double scale) {
+    struct mixoss_replay *replay;
+
+    replay = calloc(1, sizeof(struct mixoss_replay));
+    if (!replay)
+        return -1;
+
+    /* 0 replays without any delay */
+    replay->scale = scale;
+
+    lock_context(mx);
+    if (load_replay(mx, replay, path) == -1) {
+        unlock_context(mx);
+        free(replay);
+        return -1;
+    }
+    mx->replay = replay;
+    unlock_context(mx);
+    return 0;
+}
+
+int
+mixoss_connect(struct mixoss *mx, const char *path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+    mixoss_set_cloexec(fd);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        int err = errno;
+
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    lock_context(mx);
+    mx->remote_fd = fd;
+    mx->remote_in_len = 0;
+    unlock_context(mx);
+    return 0;
+}
+
+int
+mixoss_record(struct mixoss *mx, const char *path) {
+    FILE *fp;
+
+    fp = fopen(path, "w");
+    if (!fp)
+        return -1;
+    mixoss_set_cloexec(fileno(fp));
+
+    fputs("# mixoss trace 1\n", fp);
+    fputs("# time-us op dev ctrl ret errno latency-us data\n", fp);
+
+    lock_context(mx);
+    mx->record_fp = fp;
+    mx->record_start = mixoss_time_us();
+    unlock_context(mx);
+    return 0;
+}
+
+void
+mixoss_enable_stats(struct mixoss *mx) {
+    lock_context(mx);
+    mx->stats_enabled = 1;
+    unlock_context(mx);
+}
+
+int
+mixoss_load(struct mixoss *mx) {
+    int ret;
+
+    lock_context(mx);
+    ret = load_mixers(mx);
+    unlock_context(mx);
+    return ret;
+}
+
+int
+mixoss_load_infos(struct mixoss *mx) {
+    int ret;
+
+    lock_context(mx);
+    ret = load_mixer_infos(mx);
+    unlock_context(mx);
+    return ret;
+}
+
+int
+mixoss_init_mixers(struct mixoss *mx, int nb) {
+    int ret;
+
+    lock_context(mx);
+    ret = init_mixers(mx, nb);
+    unlock_context(mx);
+    return ret;
+}
+
+int
+mixoss_load_mixer(struct mixoss *mx, struct mixoss_mixer *mixer) {
+    int ret;
+
+    lock_context(mx);
+    ret = load_mixer(mx, mixer);
+    unlock_context(mx);
+    return ret;
+}
+
+void
+mixoss_refresh(struct mixoss *mx) {
+    lock_context(mx);
+    refresh_mixers(mx);
+    unlock_context(mx);
+}
+
+void
+mixoss_poll(struct mixoss *mx, struct mixoss_mixer *mixer) {
+    lock_context(mx);
+    poll_mixer_values(mx, mixer);
+    unlock_context(mx);
+}
+
+void
+mixoss_set_polled(struct mixoss *mx, struct mixoss_control *ctrl,
+                  int polled) {
+    /* The cached value of an unpolled control goes stale, the caller
+     * reads it again with mixoss_read() when it needs it */
+    lock_context(mx);
+    ctrl->no_poll = !polled;
+    unlock_context(mx);
+}
+
+void
+mixoss_free_mixers(struct mixoss *mx) {
+    lock_context(mx);
+    free_mixers(mx);
+    unlock_context(mx);
+}
+
+struct mixoss_mixer *
+mixoss_find_mixer(struct mixoss *mx, const char *name, size_t len) {
+    struct mixoss_mixer *mixer;
+
+    lock_context(mx);
+    mixer = find_mixer(mx, name, len);
+    unlock_context(mx);
+    return mixer;
+}
+
+struct mixoss_control *
+mixoss_find_control(struct mixoss *mx, struct mixoss_mixer *mixer,
+                    const char *id) {
+    struct mixoss_control *ctrl;
+
+    lock_context(mx);
+    ctrl = find_control(mixer, id);
+    unlock_context(mx);
+    return ctrl;
+}
+
+struct mixoss_mixer *
+mixoss_find_control_mixer(struct mixoss *mx, const char *name,
+                          const char **pid) {
+    struct mixoss_mixer *mixer;
+
+    lock_context(mx);
+    mixer = find_control_mixer(mx, name, pid);
+    unlock_context(mx);
+    return mixer;
+}
+
+struct mixoss_control *
+mixoss_lookup(struct mixoss *mx, const char *name) {
+    struct mixoss_control *ctrl;
+    struct mixoss_mixer *mixer;
+    const char *id;
+
+    lock_context(mx);
+    mixer = find_control_mixer(mx, name, &id);
+    ctrl = mixer ? find_control(mixer, id) : NULL;
+    unlock_context(mx);
+    return ctrl;
+}
+
+struct mixoss_control *
+mixoss_get_control(struct mixoss *mx, int dev, int ctrl) {
+    struct mixoss_control *control;
+
+    lock_context(mx);
+    control = NULL;
+    if (dev >= 0 && dev < mx->nb_mixers
+     && ctrl >= 0 && ctrl < mx->mixers[dev].nb_controls) {
+        control = &mx->mixers[dev].controls[ctrl];
+    }
+    unlock_context(mx);
+    return control;
+}
+
+int
+mixoss_read(struct mixoss *mx, struct mixoss_control *ctrl) {
+    int ret;
+
+    lock_context(mx);
+    ret = read_control(mx, ctrl);
+    unlock_context(mx);
+    return ret;
+}
+
+int
+mixoss_write(struct mixoss *mx, struct mixoss_control *ctrl, int value) {
+    int ret;
+
+    lock_context(mx);
+    ret = write_control(mx, ctrl, value);
+    unlock_context(mx);
+    return ret;
+}
+
+void
+mixoss_queue_write(struct mixoss *mx, struct mixoss_control *ctrl,
+                   int value) {
+    lock_context(mx);
+    queue_control_write(mx, ctrl, value);
+    unlock_context(mx);
+}
+
+int
+mixoss_flush(struct mixoss *mx) {
+    int ret;
+
+    lock_context(mx);
+    ret = flush_control_writes(mx);
+    unlock_context(mx);
+    return ret;
+}
+
+int
+mixoss_ioctl(struct mixoss *mx, enum mixoss_op op,
+             struct mixoss_control *ctrl, unsigned long req, void *arg) {
+    int ret;
+
+    lock_context(mx);
+    ret = mixer_ioctl(mx, op, ctrl, req, arg);
+    unlock_context(mx);
+    return ret;
+}
+
+int
+mixoss_raw_ioctl(struct mixoss *mx, enum mixoss_op op,
+                 struct mixoss_control *ctrl, unsigned long req, void *arg) {
+    int ret;
+
+    /* Without any health tracking, e.g. to probe data which may be
+     * stale */
+    lock_context(mx);
+    ret = traced_ioctl(mx, op, ctrl, req, arg);
+    unlock_context(mx);
+    return ret;
+}
+
+int
+mixoss_shm_open(struct mixoss_shm_reader *reader, const char *path) {
+    memset(reader, 0, sizeof(*reader));
+    if (strlen(path) >= sizeof(reader->path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(reader->path, path);
+
+    return map_shm(reader);
+}
+
+void
+mixoss_shm_close(struct mixoss_shm_reader *reader) {
+    if (reader->hdr)
+        munmap((void *)reader->hdr, reader->size);
+    reader->hdr = NULL;
+}
+
+int
+mixoss_shm_read(struct mixoss_shm_reader *reader, const char *name,
+                struct mixoss_shm_control *sctrl) {
+    unsigned long long deadline;
+    unsigned int seq;
+    int ret, err;
+
+    /* The writer replaced the segment, e.g. to grow it */
+    if (!reader->hdr || reader->hdr->obsolete) {
+        mixoss_shm_close(reader);
+        if (map_shm(reader) == -1) {
+            errno = ESTALE;
+            return -1;
+        }
+    }
+
+    /* An update takes microseconds, a writer which died in the middle of
+     * one must not hang the reader */
+    deadline = mixoss_time_us() + 100000;
+    do {
+        while ((seq = reader->hdr->seq) & 1) {
+            if (mixoss_time_us() >= deadline) {
+                errno = EAGAIN;
+                return -1;
+            }
+        }
+        mixoss_memory_barrier();
+
+        ret = find_shm_control(reader->hdr, name, sctrl);
+        err = errno;
+
+        mixoss_memory_barrier();
+    } while (reader->hdr->seq != seq);
+
+    errno = err;
+    return ret;
+}
@@ -14,275 +14,874 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <fcntl.h>
-#include <sys/ioctl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/select.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <getopt.h>
 #include <unistd.h>
 
 #include <curses.h>
 
-#include <soundcard.h>
+#include "mixoss.h"
 
-struct control {
-    struct oss_mixext info;
-    int is_vmix;
-    int vmix_dev;
-    int needs_redraw;
+/* Location of a control as persisted in the map file, used to reach a
+ * control without enumerating its mixer. */
+struct map_entry {
+    int dev;
+    int ctrl;
+    int timestamp;
+    char mixer_name[32];
+    char mixer_id[16];
+    char id[16];
+    char extname[32];
 
-    struct control *ui_prev;
-    struct control *ui_next;
+    struct mixoss_control *ctrl_data;
 };
 
-struct mixer {
-    struct oss_mixerinfo info;
+/* A -s or -g operation of the command line */
+struct cli_op {
+    const char *name;
+    const char *values; /* NULL for a get */
+    struct mixoss_control *ctrl;
+    struct map_entry *entry;
+};
+
+/* Application behind a vmix channel, read again when it is opened or
+ * closed */
+struct vmix_owner {
+    int known;
+    int busy;
+    int pid;
+    char label[16];
+    char cmd[64];
+};
+
+#define SEARCH_KEY_SIZE 96
 
-    struct control *controls;
+/* What the TUI shows of the current mixer, rebuilt whenever the library
+ * reloads its controls */
+struct ui_mixer {
+    unsigned int generation;
+    enum mixoss_health drawn_health;
+
+    struct mixoss_control **sliders; /* device ones first, then vmix */
+    int nb_sliders;
+    int nb_dev_sliders;
+    int nb_idle_vmix; /* collapsed, not in sliders */
+    int needs_layout; /* a vmix channel was opened or closed */
+    int curr; /* index in sliders, -1 without any */
+    char selected_id[16];
+
+    char (*search_keys)[SEARCH_KEY_SIZE]; /* by index in sliders */
+    char *matched; /* by index in sliders, while searching */
+
+    char *needs_redraw; /* by control index */
+    struct vmix_owner *owners; /* by control index */
     int nb_controls;
+};
+
+/* Fade of a slider towards a target, stepped by run_ramps() */
+struct ramp {
+    struct mixoss_control *ctrl;
+    int dev;
+    unsigned int generation; /* of the mixer, the ramp is dropped after a
+                              * reload */
+    int from_left, from_right; /* % */
+    int to_left, to_right;     /* % */
+    unsigned long long start;    /* us */
+    unsigned long long duration; /* us */
+
+    struct ramp *next;
+};
+
+#define NB_SCENES 10
+
+struct scene_value {
+    int ctrl;
+    char id[16];
+    int value;
+};
+
+/* Values of the writable controls of a mixer, recalled with one key */
+struct scene {
+    int dev;
+    struct scene_value *values; /* NULL for an empty slot */
+    int nb_values;
+};
+
+#define CLIENT_MAX_OUTPUT (256 * 1024)
+#define CONTROL_NAME_SIZE 32
+
+/* Sliders moved together from the TUI */
+struct group {
+    char name[32];
+    int relative; /* members keep their offsets, else they get one value */
+    char (*members)[CONTROL_NAME_SIZE]; /* dev:id */
+    int nb_members;
+};
+
+/* Destination following a source, scaled into min..max percent */
+struct mirror {
+    char source[CONTROL_NAME_SIZE]; /* dev:id */
+    char destination[CONTROL_NAME_SIZE];
+    int min, max;
+
+    int written; /* raw value last written to the destination */
+    int has_written;
+    unsigned long written_round; /* run_mirrors() round of the write */
+};
+
+/* Target lowered while an engine with the trigger label is busy */
+struct duck {
+    char trigger[16]; /* engine label */
+    char target[CONTROL_NAME_SIZE]; /* engine label or control name */
+    int amount;   /* % taken off the level */
+    int duration; /* ms */
+
+    int active;
+    int saved_left, saved_right; /* % restored once the engine is idle */
+};
+
+/* Slider never left above max */
+struct ceiling {
+    char name[CONTROL_NAME_SIZE]; /* dev:id */
+    int dev;
+    int max; /* % */
+
+    int counter; /* modify_counter of the mixer at the last check */
+};
+
+/* Command run when a control, or any control of a mixer, changes */
+struct hook {
+    char pattern[CONTROL_NAME_SIZE]; /* dev:id, or dev:* */
+    char *command;
+
+    int pending;
+    unsigned long long fire_at; /* us, end of the coalescing window */
+    char name[CONTROL_NAME_SIZE]; /* latest change */
+    char value[32];
+    pid_t pid; /* 0 when not running */
+};
+
+#define JOURNAL_BUFFER_SIZE (64 * 1024)
 
-    struct control *ui_dev_controls;
-    struct control *ui_vmix_controls;
+/* Change journal, written by its own thread so that the disk never
+ * slows the loops down */
+struct journal {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int fd;
+    int stop;
+
+    char *buf; /* filled by dispatch_changes(), swapped by the writer */
+    size_t len;
+    unsigned long nb_dropped; /* records lost to a full buffer */
+};
+
+/* vmix engine, as of the last ducking check */
+struct engine {
+    struct mixoss_control *ctrl;
+    char label[16];
+    int busy;
+};
+
+/* A connection to the daemon */
+struct client {
+    int fd;
+    int closed;
+
+    char in[MIXOSS_LINE_SIZE];
+    size_t in_len;
+
+    char *out;
+    size_t out_len;
+    size_t out_size;
 
-    struct control *ui_curr_control;
+    int subscribed;
+    char (*filters)[CONTROL_NAME_SIZE]; /* dev:id, none for all controls */
+    int nb_filters;
+
+    struct client *next;
 };
 
 static const char *mixer_dev = "/dev/mixer";
-static int mixer_fd;
 
-static struct mixer *mixers;
-static int nb_mixers;
-static struct mixer *cur_mixer;
+static struct mixoss *mx;
+static int cur_dev;
+static struct ui_mixer ui;
 
 static const char *title = "mixoss";
 static int label_padding = 12;
 static int gauge_width = 20;
 static int poll_interval = 250; /* ms */
+static int fade_duration = 0; /* ms, 0 to jump to the target */
+static int fade_tick = 20; /* ms */
+
+static int ui_active;
+static char (*collapsed_groups)[CONTROL_NAME_SIZE]; /* dev:id */
+static int nb_collapsed_groups;
+static const char *fifo_path;
+static int fifo_fd = -1;
+static int fifo_created;
+static char fifo_in[256];
+static size_t fifo_in_len;
+static int searching;
+static char search_query[32];
+static int search_len;
+static char search_prev_id[16]; /* selected before the search */
+static char status_msg[256];
+static int status_count;
+
+static struct cli_op *cli_ops;
+static int nb_cli_ops;
+
+static struct scene scenes[NB_SCENES];
+
+static struct ramp *ramps;
+static unsigned long long next_ramp_tick; /* us */
+
+static const char *map_path;
+static struct map_entry *map_entries;
+static int nb_map_entries;
+
+enum watch_format {
+    WATCH_NONE,
+    WATCH_JSON,  /* JSON Lines, one event per change */
+    WATCH_I3BAR, /* i3bar protocol */
+    WATCH_TEXT,  /* one plain line per change, e.g. for lemonbar */
+};
 
-static int get_mixer_info(struct oss_mixerinfo *);
-static int get_control_volume(struct control *);
-static int set_control_volume(struct control *, int);
-static void reverse_control_list(struct control **);
-static int load_mixers();
-static void free_mixers();
+static enum watch_format watch_format = WATCH_NONE;
+static int watch_window = 100; /* ms */
+static char (*watch_names)[CONTROL_NAME_SIZE];
+
+static const char *groups_path;
+static struct group *groups;
+static int nb_groups;
+static int groups_linked = 1;
+
+static const char *mirrors_path;
+static struct mirror *mirrors;
+static int nb_mirrors;
+static unsigned long mirror_round;
+
+static const char *ducks_path;
+static struct duck *ducks;
+static int nb_ducks;
+static int duck_interval = 50; /* ms */
+static unsigned long long next_duck_check; /* us */
+static struct engine *engines;
+static int nb_engines;
+
+static const char *ceilings_path;
+static struct ceiling *ceilings;
+static int nb_ceilings;
+static int ceiling_interval = 50; /* ms */
+static unsigned long long next_ceiling_check; /* us */
+
+static const char *hooks_path;
+static struct hook *hooks;
+static int nb_hooks;
+static int hook_window = 200; /* ms */
+static int max_hook_jobs = 4;
+static int nb_hook_jobs;
+extern char **environ;
+
+static const char *journal_path;
+static struct journal journal;
+static int journal_flush_interval = 1000; /* ms */
+static int journal_sync_interval = 5000; /* ms, 0 to sync every flush */
+
+static const char *export_path;
+static unsigned long export_errors;
+static int export_written;
+static enum mixoss_health *exported_health;
+static int nb_exported_health;
+
+static const char *shm_path;
+static struct mixoss_shm_header *shm;
+static size_t shm_size;
+
+static const char *socket_path;
+static struct client *clients;
+static volatile sig_atomic_t quit_requested;
+
+static double replay_scale = 1.0;
+
+static int stats_dump;
+static int stats_shown;
+
+static void report_error(void *, const char *);
+static int get_socket_addr(struct sockaddr_un *);
+static int connect_daemon();
+
+static int is_stale_ramp(const struct ramp *);
+static struct ramp *find_ramp(struct mixoss_control *);
+static void cancel_ramp(struct mixoss_control *);
+static void get_ramp_levels(const struct ramp *, unsigned long long,
+                            int *, int *);
+static void fade_control(struct mixoss_control *, int, int, int);
+static void run_ramps(unsigned long long);
+static void wait_for_ramps();
+static int get_control_volume(struct mixoss_control *);
+static void get_target_levels(struct mixoss_control *, int *, int *);
+static int get_target_volume(struct mixoss_control *);
+static int set_control_volume(struct mixoss_control *, int);
+static int is_slider(const struct mixoss_control *);
+static int load_groups(const char *);
+static void free_groups();
+static struct group *find_group(const struct mixoss_control *);
+static void refresh_control(struct mixoss_control *);
+static void set_group_volume(struct group *, struct mixoss_control *, int);
 
 static int init_ui();
 static void free_ui();
+static void sync_ui_mixer(struct mixoss_mixer *);
+static int is_collapsed(const struct mixoss_control *);
+static struct mixoss_control *get_parent_group(struct mixoss_mixer *,
+                                               const struct mixoss_control *);
+static int is_control_hidden(struct mixoss_mixer *,
+                             const struct mixoss_control *);
+static int get_control_depth(struct mixoss_mixer *,
+                             const struct mixoss_control *);
+static int has_slider_descendant(struct mixoss_mixer *,
+                                 const struct mixoss_control *);
+static int needs_all_values();
+static void update_polled_controls(struct mixoss_mixer *);
+static void build_search_index(struct mixoss_mixer *);
+static int fuzzy_score(const char *, const char *);
+static int update_owner(struct mixoss_control *);
+static void refresh_owners(struct mixoss_mixer *);
 static void set_ui_error(const char *, ...);
-static int draw_control(struct control *, int, int, int);
+static void draw_status();
+static int draw_control(struct mixoss_control *, int, int, int);
+static void draw_stats();
 static void draw_ui();
+static void toggle_stats();
+static void dump_stats();
 
+static void select_slider(int);
 static void move_to_next_control();
 static void move_to_previous_control();
+static void toggle_collapse();
+static void expand_parent_groups(struct mixoss_mixer *,
+                                 const struct mixoss_control *);
+static int match_search();
+static void run_search();
+static void start_search();
+static void stop_search(int);
+static void handle_search_key(int);
+static void set_linked_volume(struct mixoss_control *, int);
 static void modify_volume(int);
 static void set_volume(int);
+static void toggle_groups();
+static int open_fifo();
+static void close_fifo();
+static void read_fifo();
+static struct mixoss_control *find_mute_control(struct mixoss_control *);
+static void run_fifo_command(char *);
+
+static struct mixoss_control *resolve_control(const char *);
+static FILE *create_temp_file(const char *, char *, size_t);
+static int commit_temp_file(FILE *, const char *, const char *);
+static void get_map_path();
+static int load_control_map();
+static void save_control_map();
+static void free_control_map();
+static struct map_entry *find_map_entry(const char *);
+static int resolve_cli_ops_fast();
+static int run_cli();
+static int apply_cli_ops();
+static int run_store(const char *);
+static int run_restore(const char *);
+static void capture_scene(int);
+static void recall_scene(int);
+static int open_shm(unsigned int);
+static void close_shm();
+static void publish_state();
+static int load_mirrors(const char *);
+static int is_mirror_echo(const struct mixoss_control *, const char *);
+static int run_mirrors();
+static int load_ducks(const char *);
+static void scan_engines();
+static struct engine *find_engine(const char *);
+static int is_engine_busy(const char *);
+static void check_ducks(unsigned long long);
+static int load_ceilings(const char *);
+static void check_ceilings(unsigned long long);
+static int load_hooks(const char *);
+static void free_hooks();
+static void queue_hooks(const struct mixoss_control *, unsigned long long);
+static void start_hook(struct hook *);
+static void run_hooks(unsigned long long);
+static unsigned long long next_hook_deadline(unsigned long long);
+static int open_journal();
+static void close_journal();
+static void *run_journal(void *);
+static void format_journal_value(const struct mixoss_control *, int,
+                                 char *, size_t);
+static size_t write_journal(const char *, size_t);
+static void journal_change(void *, const struct mixoss_control *, int, int);
+static void dispatch_changes();
+static int run_peek(const char **, int);
+static void print_prom_string(FILE *, const char *);
+static void write_control_metrics(FILE *);
+static void write_mixer_metrics(FILE *);
+static void export_metrics(int);
+static int run_export();
+static void request_quit(int);
+static void catch_quit_signals();
+static int open_server_socket();
+static void accept_client(int);
+static void free_client(struct client *);
+static void send_to_client(struct client *, const char *, ...);
+static void flush_client(struct client *);
+static void serve_ioctl(struct client *, char *);
+static void handle_request(struct client *, char *);
+static void read_client(struct client *);
+static void notify_clients(const struct mixoss_control *);
+static int run_daemon();
+static int is_watched(const struct mixoss_control *);
+static void print_json_string(const char *);
+static void format_bar_value(const struct mixoss_control *, char *, size_t);
+static void print_watch_event(const struct mixoss_control *, const char *);
+static void print_watch_line();
+static void print_watch_changes(int);
+static int run_watch();
+static int run_ui();
+static int parse_int_option(const char *, const char *, int);
+static int load_state();
+
+static void
+report_error(void *data, const char *msg) {
+    set_ui_error("%s", msg);
+}
 
 static int
-get_mixer_info(struct oss_mixerinfo *info) {
-    errno = 0;
-    if (ioctl(mixer_fd, SNDCTL_MIXERINFO, info) == -1) {
-        set_ui_error("cannot get mixer info: %s", strerror(errno));
+get_socket_addr(struct sockaddr_un *addr) {
+    static char path[sizeof(addr->sun_path)];
+
+    if (!socket_path) {
+        mixoss_runtime_path(path, sizeof(path), "sock");
+        socket_path = path;
+    }
+
+    if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
         return -1;
     }
 
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, socket_path);
     return 0;
 }
 
 static int
-get_control_volume(struct control *ctrl) {
-    struct oss_mixer_value val;
-    struct oss_mixext *ext;
-    int vleft, vright;
-    int min, max;
-
-    ext = &ctrl->info;
+connect_daemon() {
+    struct sockaddr_un addr;
 
-    val.dev = cur_mixer->info.dev;
-    val.ctrl = ext->ctrl;
-    val.timestamp = ext->timestamp;
-    val.value = -1;
-
-    if (ioctl(mixer_fd, SNDCTL_MIX_READ, &val) == -1) {
-        set_ui_error("cannot get volume of control %s: %s",
-                ctrl->info.id, strerror(errno));
+    if (get_socket_addr(&addr) == -1
+     || mixoss_connect(mx, socket_path) == -1) {
+        fprintf(stderr, "cannot connect to %s: %s\n",
+                socket_path, strerror(errno));
         return -1;
     }
 
-    if (ext->type == MIXT_STEREOSLIDER) {
-        vleft = val.value & 0xff;
-        vright = (val.value >> 8) & 0xffff;
-    } else if (ext->type == MIXT_STEREOSLIDER16) {
-        vleft = val.value & 0xffff;
-        vright = (val.value >> 16) & 0xffff;
-    } else {
-        vleft = 0;
-        vright = 0;
+    return 0;
+}
+
+static int
+is_stale_ramp(const struct ramp *ramp) {
+    /* The control went away with a reload of its mixer */
+    return mx->mixers[ramp->dev].generation != ramp->generation;
+}
+
+static struct ramp *
+find_ramp(struct mixoss_control *ctrl) {
+    for (struct ramp *ramp = ramps; ramp; ramp = ramp->next) {
+        if (ramp->ctrl == ctrl && !is_stale_ramp(ramp))
+            return ramp;
     }
 
-    min = ctrl->info.minvalue;
-    max = ctrl->info.maxvalue;
+    return NULL;
+}
 
-    return min + (vleft * 100) / (max - min);
+/* Drops the ramp in flight on a control, so that its next steps do not
+ * undo a write made without it */
+static void
+cancel_ramp(struct mixoss_control *ctrl) {
+    struct ramp **pramp;
+
+    pramp = &ramps;
+    while (*pramp) {
+        struct ramp *ramp = *pramp;
+
+        if (ramp->ctrl == ctrl) {
+            *pramp = ramp->next;
+            free(ramp);
+        } else {
+            pramp = &ramp->next;
+        }
+    }
 }
 
-static int
-set_control_volume(struct control *ctrl, int volume) {
-    struct oss_mixext *ext;
-    struct oss_mixer_value val;
-    int vleft, vright;
-    int min, max;
-    int level;
+static void
+get_ramp_levels(const struct ramp *ramp, unsigned long long now,
+                int *pleft, int *pright) {
+    unsigned long long elapsed;
 
-    ext = &ctrl->info;
+    elapsed = now - ramp->start;
+    if (now < ramp->start)
+        elapsed = 0;
+
+    if (elapsed >= ramp->duration) {
+        *pleft = ramp->to_left;
+        *pright = ramp->to_right;
+        return;
+    }
 
-    min = ext->minvalue;
-    max = ext->maxvalue;
+    *pleft = ramp->from_left
+           + (ramp->to_left - ramp->from_left) * (long long)elapsed
+             / (long long)ramp->duration;
+    *pright = ramp->from_right
+            + (ramp->to_right - ramp->from_right) * (long long)elapsed
+              / (long long)ramp->duration;
+}
+
+static void
+fade_control(struct mixoss_control *ctrl, int left, int right, int duration) {
+    unsigned long long now;
+    struct ramp *ramp;
+
+    ramp = find_ramp(ctrl);
+
+    if (duration <= 0
+     || (ctrl->info.type != MIXT_STEREOSLIDER
+      && ctrl->info.type != MIXT_STEREOSLIDER16
+      && ctrl->info.type != MIXT_MONOSLIDER
+      && ctrl->info.type != MIXT_MONOSLIDER16
+      && ctrl->info.type != MIXT_SLIDER)) {
+        cancel_ramp(ctrl);
+        mixoss_queue_write(mx, ctrl, mixoss_encode_value(ctrl, left, right));
+        return;
+    }
 
-    vleft = min + (volume * (max - min)) / 100;
-    vright = vleft;
+    now = mixoss_time_us();
 
-    if (ext->type == MIXT_STEREOSLIDER) {
-        volume = vleft | (vright << 8);
-    } else if (ext->type == MIXT_STEREOSLIDER16) {
-        volume = vleft | (vright << 16);
+    if (ramp) {
+        /* Retarget from wherever the ramp in flight currently is */
+        get_ramp_levels(ramp, now, &ramp->from_left, &ramp->from_right);
     } else {
-        volume = 0;
+        ramp = calloc(1, sizeof(struct ramp));
+        if (!ramp) {
+            mixoss_queue_write(mx, ctrl,
+                               mixoss_encode_value(ctrl, left, right));
+            return;
+        }
+
+        ramp->ctrl = ctrl;
+        ramp->dev = ctrl->info.dev;
+        ramp->generation = mx->mixers[ramp->dev].generation;
+        mixoss_decode_value(ctrl, ctrl->value,
+                            &ramp->from_left, &ramp->from_right);
+
+        if (!ramps)
+            next_ramp_tick = now;
+        ramp->next = ramps;
+        ramps = ramp;
     }
 
-    val.dev = cur_mixer->info.dev;
-    val.ctrl = ext->ctrl;
-    val.timestamp = ext->timestamp;
-    val.value = volume;
+    ramp->to_left = left;
+    ramp->to_right = right;
+    ramp->start = now;
+    ramp->duration = duration * 1000ULL;
+}
 
-    if (ioctl(mixer_fd, SNDCTL_MIX_WRITE, &val) == -1) {
-        set_ui_error("cannot set volume of control %s: %s",
-                ctrl->info.id, strerror(errno));
-        return -1;
+static void
+run_ramps(unsigned long long now) {
+    struct ramp **pramp;
+
+    pramp = &ramps;
+    while (*pramp) {
+        struct ramp *ramp = *pramp;
+
+        if (is_stale_ramp(ramp)) {
+            *pramp = ramp->next;
+            free(ramp);
+        } else {
+            pramp = &ramp->next;
+        }
     }
 
-    return 0;
+    /* All ramps share a single tick: each one queues its next step, and
+     * the writes are flushed together, device by device. */
+    for (struct ramp *ramp = ramps; ramp; ramp = ramp->next) {
+        int left, right;
+        int value;
+
+        get_ramp_levels(ramp, now, &left, &right);
+
+        value = mixoss_encode_value(ramp->ctrl, left, right);
+        if (value != ramp->ctrl->value)
+            mixoss_queue_write(mx, ramp->ctrl, value);
+    }
+
+    mixoss_flush(mx);
+
+    pramp = &ramps;
+    while (*pramp) {
+        struct ramp *ramp = *pramp;
+
+        if (now - ramp->start >= ramp->duration
+         || ramp->ctrl->write_error) {
+            *pramp = ramp->next;
+            free(ramp);
+        } else {
+            pramp = &ramp->next;
+        }
+    }
+
+    next_ramp_tick = now + fade_tick * 1000ULL;
 }
 
 static void
-reverse_control_list(struct control **plist) {
-    struct control *curr, *temp;
+wait_for_ramps() {
+    while (ramps) {
+        unsigned long long now;
+
+        now = mixoss_time_us();
+        if (now < next_ramp_tick) {
+            struct timespec ts;
 
-    curr = *plist;
+            ts.tv_sec = (next_ramp_tick - now) / 1000000;
+            ts.tv_nsec = ((next_ramp_tick - now) % 1000000) * 1000;
+            nanosleep(&ts, NULL);
+            continue;
+        }
 
-    while (curr) {
-        temp = curr->ui_next;
-        curr->ui_next = curr->ui_prev;
-        curr->ui_prev = temp;
-        *plist = curr;
-        curr = temp;
+        run_ramps(now);
     }
 }
 
 static int
-load_mixers() {
-    if (ioctl(mixer_fd, SNDCTL_MIX_NRMIX, &nb_mixers) == -1) {
-        perror("cannot get number of mixers");
-        return -1;
+get_control_volume(struct mixoss_control *ctrl) {
+    int left, right;
+
+    /* From the cache, kept up to date by mixoss_poll() */
+    if (mixoss_decode_value(ctrl, ctrl->value, &left, &right) == 0)
+        return 0;
+
+    return left;
+}
+
+static void
+get_target_levels(struct mixoss_control *ctrl, int *pleft, int *pright) {
+    struct ramp *ramp;
+
+    ramp = find_ramp(ctrl);
+    if (ramp) {
+        *pleft = ramp->to_left;
+        *pright = ramp->to_right;
+        return;
     }
-    if (!nb_mixers) {
-        fflush(stdout);
-        fputs("no mixer found", stderr);
-        return -1;
+
+    if (mixoss_decode_value(ctrl, ctrl->value, pleft, pright) == 0) {
+        *pleft = 0;
+        *pright = 0;
     }
+}
+
+static int
+get_target_volume(struct mixoss_control *ctrl) {
+    int left, right;
 
-    mixers = calloc(nb_mixers, sizeof(struct mixer));
-    if (!mixers) {
-        perror("cannot allocate mixer structures");
+    get_target_levels(ctrl, &left, &right);
+    return left;
+}
+
+static int
+set_control_volume(struct mixoss_control *ctrl, int volume) {
+    fade_control(ctrl, volume, volume, fade_duration);
+    return mixoss_flush(mx) > 0 ? -1 : 0;
+}
+
+static int
+is_slider(const struct mixoss_control *ctrl) {
+    return ctrl->info.type == MIXT_STEREOSLIDER
+        || ctrl->info.type == MIXT_STEREOSLIDER16
+        || ctrl->info.type == MIXT_MONOSLIDER
+        || ctrl->info.type == MIXT_MONOSLIDER16
+        || ctrl->info.type == MIXT_SLIDER;
+}
+
+static int
+load_groups(const char *path) {
+    char line[1024];
+    int nb_lines;
+    FILE *fp;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
         return -1;
     }
 
-    for (int m = 0; m < nb_mixers; m++) {
-        struct mixer *mixer = &mixers[m];
+    nb_lines = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        struct group *group;
+        char *name, *mode, *tok;
 
-        mixer->info.dev = m;
+        nb_lines++;
+        if (line[0] == '#')
+            continue;
 
-        errno = 0;
-        if (ioctl(mixer_fd, SNDCTL_MIXERINFO, &mixer->info) == -1) {
-            perror("cannot get mixer info");
-            free_mixers();
-            return -1;
-        }
+        /* name absolute|relative control... */
+        name = strtok(line, " \t\n");
+        if (!name)
+            continue;
 
-        mixer->nb_controls = mixer->info.nrext;
-        mixer->controls = calloc(mixer->nb_controls, sizeof(struct control));
-        if (!mixer->controls) {
-            perror("cannot allocate control structures");
-            free_mixers();
-            return -1;
+        mode = strtok(NULL, " \t\n");
+        if (!mode || (strcmp(mode, "absolute") != 0
+                   && strcmp(mode, "relative") != 0)) {
+            fprintf(stderr, "%s:%d: invalid mode\n", path, nb_lines);
+            goto error;
         }
 
-        if (!mixer->info.enabled) {
-            /* e.g. disconnected USB device */
-            fprintf(stderr, "found a disabled device: '%s'\n",
-                    mixer->info.name);
-            continue;
+        group = realloc(groups, (nb_groups + 1) * sizeof(struct group));
+        if (!group) {
+            perror("cannot allocate groups");
+            goto error;
         }
+        groups = group;
+
+        group = &groups[nb_groups++];
+        memset(group, 0, sizeof(*group));
+        snprintf(group->name, sizeof(group->name), "%s", name);
+        group->relative = strcmp(mode, "relative") == 0;
+
+        while ((tok = strtok(NULL, " \t\n"))) {
+            struct mixoss_control *ctrl;
+            void *members;
+
+            ctrl = mixoss_lookup(mx, tok);
+            if (!ctrl || !is_slider(ctrl)) {
+                fprintf(stderr, "%s:%d: unknown slider '%s'\n",
+                        path, nb_lines, tok);
+                goto error;
+            }
 
-        for (int e = 0; e < mixer->nb_controls; e++) {
-            struct control *ctrl = &mixers->controls[e];
+            members = realloc(group->members, (group->nb_members + 1)
+                                              * sizeof(*group->members));
+            if (!members) {
+                perror("cannot allocate group members");
+                goto error;
+            }
+            group->members = members;
 
-            ctrl->info.dev = m;
-            ctrl->info.ctrl = e;
+            /* Names are kept rather than pointers, which do not survive
+             * a reload of the mixer */
+            mixoss_format_name(ctrl, group->members[group->nb_members],
+                               sizeof(*group->members));
+            group->nb_members++;
+        }
+    }
 
-            errno = 0;
-            if (ioctl(mixer_fd, SNDCTL_MIX_EXTINFO, &ctrl->info) == -1) {
-                perror("cannot get mixer extension info");
-                free_mixers();
-                break;
-            }
+    fclose(fp);
+    return 0;
+
+error:
+    fclose(fp);
+    free_groups();
+    return -1;
+}
 
-            if (sscanf(ctrl->info.id, "@pcm%d", &ctrl->vmix_dev) == 1)
-                ctrl->is_vmix = 1;
+static void
+free_groups() {
+    for (int g = 0; g < nb_groups; g++)
+        free(groups[g].members);
 
-            ctrl->needs_redraw = 1;
+    free(groups);
+    groups = NULL;
+    nb_groups = 0;
+}
 
-            if (ctrl->info.type == MIXT_STEREOSLIDER
-             || ctrl->info.type == MIXT_STEREOSLIDER16) {
-                if (ctrl->is_vmix) {
-                    if (mixer->ui_vmix_controls)
-                        mixer->ui_vmix_controls->ui_prev = ctrl;
-                    ctrl->ui_next = mixer->ui_vmix_controls;
-                    mixer->ui_vmix_controls = ctrl;
-                } else {
-                    if (mixer->ui_dev_controls)
-                        mixer->ui_dev_controls->ui_prev = ctrl;
-                    ctrl->ui_next = mixer->ui_dev_controls;
-                    mixer->ui_dev_controls = ctrl;
-                }
-            }
-        }
+static struct group *
+find_group(const struct mixoss_control *ctrl) {
+    char name[CONTROL_NAME_SIZE];
 
-        reverse_control_list(&mixer->ui_dev_controls);
-        reverse_control_list(&mixer->ui_vmix_controls);
+    mixoss_format_name(ctrl, name, sizeof(name));
 
-        mixer->ui_curr_control = mixer->ui_dev_controls;
+    for (int g = 0; g < nb_groups; g++) {
+        for (int i = 0; i < groups[g].nb_members; i++) {
+            if (strcmp(groups[g].members[i], name) == 0)
+                return &groups[g];
+        }
     }
 
-    return 0;
+    return NULL;
 }
 
+/* Only the controls on screen are polled, the cached value of the others
+ * may be stale */
 static void
-free_mixers() {
-    if (nb_mixers == 0)
-        return;
+refresh_control(struct mixoss_control *ctrl) {
+    if (ctrl->info.dev != cur_dev || ctrl->no_poll)
+        mixoss_read(mx, ctrl);
+}
+
+static void
+set_group_volume(struct group *group, struct mixoss_control *ctrl,
+                 int volume) {
+    int left, right;
+    int delta;
+
+    get_target_levels(ctrl, &left, &right);
+    delta = volume - left;
+
+    /* Every member is computed from the cache and queued, the writes then
+     * go out in a single batch per device. */
+    for (int i = 0; i < group->nb_members; i++) {
+        struct mixoss_control *member;
+
+        member = mixoss_lookup(mx, group->members[i]);
+        if (!member)
+            continue;
 
-    for (int m = 0; m < nb_mixers; m++) {
-        struct mixer * mixer = &mixers[m];
-        free(mixer->controls);
+        if (group->relative) {
+            refresh_control(member);
+            get_target_levels(member, &left, &right);
+            left += delta;
+            right += delta;
+        } else {
+            left = volume;
+            right = volume;
+        }
+
+        left = left < 0 ? 0 : left > 100 ? 100 : left;
+        right = right < 0 ? 0 : right > 100 ? 100 : right;
+
+        fade_control(member, left, right, fade_duration);
     }
 
-    free(mixers);
+    mixoss_flush(mx);
 }
 
 static int
@@ -293,291 +892,4195 @@ init_ui() {
     cbreak();
     noecho();
 
+    ui_active = 1;
     return 0;
 }
 
 static void
 free_ui() {
     endwin();
+    ui_active = 0;
+
+    free(ui.sliders);
+    free(ui.search_keys);
+    free(ui.matched);
+    free(ui.needs_redraw);
+    free(ui.owners);
+    free(collapsed_groups);
 }
 
 static void
-set_ui_error(const char *fmt, ...) {
-    int width, height;
-    char buf[1024];
-    va_list ap;
-
-    width  = getmaxx(stdscr);
-    height = getmaxy(stdscr);
-
-    move(height - 1, 0);
-    clrtoeol();
-
-    if (fmt) {
-        va_start(ap, fmt);
-        vsnprintf(buf, 1024, fmt, ap);
-        va_end(ap);
-
-        mvaddstr(height - 1, (width - strlen(buf)) / 2, buf);
+sync_ui_mixer(struct mixoss_mixer *mixer) {
+    int reloaded;
+
+    reloaded = !ui.needs_redraw || ui.generation != mixer->generation;
+    if (!reloaded && !ui.needs_layout) {
+        if (ui.drawn_health != mixer->health) {
+            ui.drawn_health = mixer->health;
+            clear();
+            memset(ui.needs_redraw, 1, ui.nb_controls);
+        }
+        return;
     }
 
-    refresh();
-}
+    /* The controls were reloaded: the previous pointers are gone and the
+     * selection is found again by id, as indexes may have changed. Opened
+     * and closed vmix channels move sliders around the same way. */
+    free(ui.sliders);
+    free(ui.search_keys);
+    free(ui.matched);
+    free(ui.needs_redraw);
+    if (reloaded) {
+        free(ui.owners);
+        ui.owners = NULL;
+    }
 
-static int
-draw_control(struct control *ctrl, int py, int px, int selected) {
-    struct oss_mixext *ext;
-    struct oss_audioinfo ainfo;
+    ui.sliders = calloc(mixer->nb_controls + 1,
+                        sizeof(struct mixoss_control *));
+    ui.search_keys = malloc((mixer->nb_controls + 1)
+                            * sizeof(*ui.search_keys));
+    ui.matched = malloc(mixer->nb_controls + 1);
+    ui.needs_redraw = malloc(mixer->nb_controls + 1);
+    if (reloaded) {
+        ui.owners = calloc(mixer->nb_controls + 1,
+                           sizeof(struct vmix_owner));
+    }
+    ui.nb_sliders = 0;
+    ui.nb_dev_sliders = 0;
+    ui.nb_idle_vmix = 0;
+    ui.needs_layout = 0;
+    ui.curr = -1;
+    ui.nb_controls = 0;
+    if (!ui.sliders || !ui.search_keys || !ui.matched || !ui.needs_redraw
+     || !ui.owners) {
+        set_ui_error("cannot allocate sliders: %s", strerror(errno));
+        free(ui.sliders);
+        free(ui.search_keys);
+        free(ui.matched);
+        free(ui.needs_redraw);
+        free(ui.owners);
+        ui.sliders = NULL;
+        ui.search_keys = NULL;
+        ui.matched = NULL;
+        ui.needs_redraw = NULL;
+        ui.owners = NULL;
+        return;
+    }
 
-    const char *label;
-    int volume;
-    int nb_bars;
-    int x, g;
+    if (reloaded) {
+        for (int c = 0; c < mixer->nb_controls; c++) {
+            if (mixer->controls[c].is_vmix)
+                update_owner(&mixer->controls[c]);
+        }
+    }
 
-    ext = &ctrl->info;
+    for (int vmix = 0; vmix <= 1; vmix++) {
+        for (int c = 0; c < mixer->nb_controls; c++) {
+            struct mixoss_control *ctrl = &mixer->controls[c];
+
+            /* Device sliders are shown as a tree of their groups, with a
+             * header for each group holding any of them. A search goes
+             * through collapsed groups and idle channels as well. */
+            if (!vmix && ctrl->info.type == MIXT_GROUP) {
+                if ((!searching && is_control_hidden(mixer, ctrl))
+                 || !has_slider_descendant(mixer, ctrl)) {
+                    continue;
+                }
+            } else if ((ctrl->info.type != MIXT_STEREOSLIDER
+                     && ctrl->info.type != MIXT_STEREOSLIDER16)
+                    || ctrl->is_vmix != vmix
+                    || (!vmix && !searching
+                     && is_control_hidden(mixer, ctrl))) {
+                continue;
+            }
 
-    if (!ctrl->needs_redraw)
-        return 0;
+            /* Idle channels are collapsed into a single line */
+            if (vmix && !searching && !ui.owners[c].busy) {
+                ui.nb_idle_vmix++;
+                continue;
+            }
 
-    label = ext->id;
-    if (ctrl->is_vmix) {
-        ainfo.dev = ctrl->vmix_dev;
-        if (ioctl(mixer_fd, SNDCTL_ENGINEINFO, &ainfo) < 0) {
-            set_ui_error("cannot get mixer label: %s", strerror(errno));
-        } else if (*ainfo.label) {
-            label = ainfo.label;
+            if (ui.curr == -1 && strcmp(ctrl->info.id, ui.selected_id) == 0)
+                ui.curr = ui.nb_sliders;
+            ui.sliders[ui.nb_sliders++] = ctrl;
         }
-    }
 
-    volume = get_control_volume(ctrl);
-    if (volume == -1)
-        return -1;
+        if (!vmix)
+            ui.nb_dev_sliders = ui.nb_sliders;
+    }
 
-    nb_bars = (volume * gauge_width) / 100;
+    if (ui.curr == -1 && ui.nb_sliders > 0)
+        ui.curr = 0;
+    if (ui.curr >= 0)
+        strcpy(ui.selected_id, ui.sliders[ui.curr]->info.id);
 
-    if (selected)
-        attron(A_BOLD);
+    ui.nb_controls = mixer->nb_controls;
+    memset(ui.needs_redraw, 1, ui.nb_controls);
+    ui.generation = mixer->generation;
+    ui.drawn_health = mixer->health;
+    clear();
 
-    x = px;
-    mvprintw(py, x, "%- *.*s", label_padding, label_padding, label);
+    update_polled_controls(mixer);
+    build_search_index(mixer);
 
-    if (selected)
-        attroff(A_BOLD);
+    /* A search goes on over the new layout */
+    if (searching) {
+        int best;
 
-    x += label_padding + 1;
-    for (g = 0; g < nb_bars; g++) {
-        mvaddch(py, x, '|');
-        x++;
-    }
-    for (; g < gauge_width; g++) {
-        mvaddch(py, x, ' ');
-        x++;
+        best = match_search();
+        if (best >= 0 && (ui.curr < 0 || !ui.matched[ui.curr])) {
+            ui.curr = best;
+            strcpy(ui.selected_id, ui.sliders[best]->info.id);
+        }
     }
+}
 
-    if (selected)
-        attron(A_BOLD);
+static int
+is_collapsed(const struct mixoss_control *group) {
+    char name[CONTROL_NAME_SIZE];
 
-    x++;
-    mvprintw(py, x, "%3d%%", volume);
+    mixoss_format_name(group, name, sizeof(name));
 
-    if (selected)
-        attroff(A_BOLD);
+    for (int i = 0; i < nb_collapsed_groups; i++) {
+        if (strcmp(collapsed_groups[i], name) == 0)
+            return 1;
+    }
 
-    ctrl->needs_redraw = 0;
     return 0;
 }
 
-static void
-draw_ui() {
-    struct control *ctrl;
-    int width, height;
-    int py_left, py_right;
-    int px;
-    int y_max;
-    int sel;
-
-    width  = getmaxx(stdscr);
-    height = getmaxy(stdscr);
+static struct mixoss_control *
+get_parent_group(struct mixoss_mixer *mixer,
+                 const struct mixoss_control *ctrl) {
+    struct mixoss_control *parent;
+    int p;
 
-    mvaddstr(0, (80 - strlen(title)) / 2, title);
+    p = ctrl->info.parent;
+    if (p < 0 || p >= mixer->nb_controls || p == ctrl->info.ctrl)
+        return NULL;
 
-    py_left = 2;
-    for (ctrl = cur_mixer->ui_dev_controls; ctrl; ctrl = ctrl->ui_next) {
-        px = 0;
+    parent = &mixer->controls[p];
+    return parent->info.type == MIXT_GROUP ? parent : NULL;
+}
 
-        sel = ctrl == cur_mixer->ui_curr_control;
-        if (draw_control(ctrl, py_left, px, sel) == 0)
-            py_left++;
+static int
+is_control_hidden(struct mixoss_mixer *mixer,
+                  const struct mixoss_control *ctrl) {
+    struct mixoss_control *group;
+
+    /* Bounded, a broken driver could link parents in a loop */
+    group = get_parent_group(mixer, ctrl);
+    for (int i = 0; group && i < mixer->nb_controls; i++) {
+        if (is_collapsed(group))
+            return 1;
+        group = get_parent_group(mixer, group);
     }
 
-    py_right = 2;
-    for (ctrl = cur_mixer->ui_vmix_controls; ctrl; ctrl = ctrl->ui_next) {
-        px = 1 + label_padding + 2 + gauge_width + 1 + 6;
+    return 0;
+}
 
-        sel = ctrl == cur_mixer->ui_curr_control;
-        if (draw_control(ctrl, py_right, px, sel) == 0)
-            py_right++;
+static int
+get_control_depth(struct mixoss_mixer *mixer,
+                  const struct mixoss_control *ctrl) {
+    struct mixoss_control *group;
+    int depth;
+
+    depth = 0;
+    group = get_parent_group(mixer, ctrl);
+    while (group && depth < mixer->nb_controls) {
+        depth++;
+        group = get_parent_group(mixer, group);
     }
 
-    y_max = py_left > py_right ? py_left : py_right;
-    for (int y = 2; y < y_max; y++)
-        mvaddch(y, 40, ACS_VLINE);
-
-    refresh();
+    return depth;
 }
 
-static void
-move_to_next_control() {
-    struct control *curr, *next;
-
-    curr = cur_mixer->ui_curr_control;
-    next = NULL;
+static int
+has_slider_descendant(struct mixoss_mixer *mixer,
+                      const struct mixoss_control *group) {
+    for (int c = 0; c < mixer->nb_controls; c++) {
+        struct mixoss_control *ctrl = &mixer->controls[c];
+        struct mixoss_control *parent;
+
+        if ((ctrl->info.type != MIXT_STEREOSLIDER
+          && ctrl->info.type != MIXT_STEREOSLIDER16)
+         || ctrl->is_vmix) {
+            continue;
+        }
 
-    if (curr->ui_next) {
-        next = curr->ui_next;
-    } else if (!curr->is_vmix) {
-        next = cur_mixer->ui_vmix_controls;
+        parent = get_parent_group(mixer, ctrl);
+        for (int i = 0; parent && i < mixer->nb_controls; i++) {
+            if (parent == group)
+                return 1;
+            parent = get_parent_group(mixer, parent);
+        }
     }
 
-    if (next) {
-        cur_mixer->ui_curr_control = next;
-
-        curr->needs_redraw = 1;
-        next->needs_redraw = 1;
-        draw_ui();
-    }
+    return 0;
+}
+
+static int
+needs_all_values() {
+    /* Published, exported, mirrored, journaled and hooked values must
+     * stay current, displayed or not */
+    return shm || export_path || nb_mirrors > 0 || journal_path
+        || nb_hooks > 0;
+}
+
+static void
+update_polled_controls(struct mixoss_mixer *mixer) {
+    if (needs_all_values())
+        return;
+
+    /* Nothing in a collapsed group costs an ioctl. Controls showing up
+     * again are read at once, their cached value being stale. */
+    for (int c = 0; c < mixer->nb_controls; c++) {
+        struct mixoss_control *ctrl = &mixer->controls[c];
+        int hidden;
+
+        hidden = !searching && is_control_hidden(mixer, ctrl);
+        if (hidden == ctrl->no_poll)
+            continue;
+
+        mixoss_set_polled(mx, ctrl, !hidden);
+        if (!hidden && mixoss_is_value_control(ctrl))
+            mixoss_read(mx, ctrl);
+    }
+}
+
+static void
+build_search_index(struct mixoss_mixer *mixer) {
+    /* Keys are lowercased once here, so that each keystroke of a search
+     * only walks strings */
+    for (int i = 0; i < ui.nb_sliders; i++) {
+        struct mixoss_control *ctrl = ui.sliders[i];
+        struct mixoss_control *group;
+        char *key = ui.search_keys[i];
+
+        if (ctrl->is_vmix) {
+            const struct vmix_owner *owner = &ui.owners[ctrl->info.ctrl];
+
+            snprintf(key, SEARCH_KEY_SIZE, "%s %s %s", ctrl->info.id,
+                     owner->label, owner->cmd);
+        } else {
+            group = get_parent_group(mixer, ctrl);
+            snprintf(key, SEARCH_KEY_SIZE, "%s %s", ctrl->info.id,
+                     group ? group->info.id : "");
+        }
+
+        for (char *ptr = key; *ptr; ptr++)
+            *ptr = tolower((unsigned char)*ptr);
+    }
+}
+
+static int
+fuzzy_score(const char *key, const char *query) {
+    const char *ptr;
+    int score, prev;
+
+    /* Every character of the query must appear in order. Runs of
+     * consecutive characters and matches at the start of a word score
+     * higher. */
+    score = 0;
+    prev = -2;
+    ptr = key;
+    for (const char *q = query; *q; q++) {
+        int pos;
+
+        ptr = strchr(ptr, *q);
+        if (!ptr)
+            return -1;
+
+        pos = ptr - key;
+        score++;
+        if (pos == prev + 1)
+            score += 4;
+        if (pos == 0 || strchr(" .-_@", key[pos - 1]))
+            score += 2;
+
+        prev = pos;
+        ptr++;
+    }
+
+    return score;
+}
+
+static int
+update_owner(struct mixoss_control *ctrl) {
+    struct vmix_owner *owner = &ui.owners[ctrl->info.ctrl];
+    struct oss_audioinfo ainfo;
+    int busy, moved;
+
+    ainfo.dev = ctrl->vmix_dev;
+    if (mixoss_ioctl(mx, MIXOSS_OP_ENGINEINFO, ctrl,
+                     SNDCTL_ENGINEINFO, &ainfo) < 0) {
+        set_ui_error("cannot get engine info: %s", strerror(errno));
+        return 0;
+    }
+
+    busy = ainfo.busy != 0;
+    if (owner->known && owner->busy == busy && owner->pid == ainfo.pid)
+        return 0;
+
+    /* An application may close a channel and another one open it within
+     * a single tick, only its details change then */
+    moved = !owner->known || owner->busy != busy;
+    if (!moved && ui.needs_redraw)
+        ui.needs_redraw[ctrl->info.ctrl] = 1;
+
+    owner->known = 1;
+    owner->busy = busy;
+    owner->pid = ainfo.pid;
+    snprintf(owner->label, sizeof(owner->label), "%.*s",
+             (int)sizeof(ainfo.label), ainfo.label);
+    snprintf(owner->cmd, sizeof(owner->cmd), "%.*s",
+             (int)sizeof(ainfo.cmd), ainfo.cmd);
+    return moved;
+}
+
+static void
+refresh_owners(struct mixoss_mixer *mixer) {
+    if (!ui.owners || ui.generation != mixer->generation)
+        return;
+
+    /* Only the open state and the pid are compared on every tick: owners
+     * are copied and drawn again when a channel changes hands. */
+    for (int c = 0; c < mixer->nb_controls; c++) {
+        if (mixer->controls[c].is_vmix && update_owner(&mixer->controls[c]))
+            ui.needs_layout = 1;
+    }
+}
+
+static void
+set_ui_error(const char *fmt, ...) {
+    char buf[sizeof(status_msg)];
+    va_list ap;
+
+    if (!fmt) {
+        status_msg[0] = '\0';
+        status_count = 0;
+        draw_status();
+        return;
+    }
+
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    /* Repeated errors only bump a counter instead of flooding the status
+     * line; it is drawn with the next frame. */
+    if (strcmp(buf, status_msg) == 0) {
+        status_count++;
+    } else {
+        strcpy(status_msg, buf);
+        status_count = 1;
+    }
+
+    if (!ui_active) {
+        if (status_count == 1)
+            fprintf(stderr, "%s\n", status_msg);
+        return;
+    }
+
+    draw_status();
+}
+
+static void
+draw_status() {
+    int width, height;
+    char buf[sizeof(status_msg) + 32];
+    int len;
+
+    if (!ui_active)
+        return;
+
+    width  = getmaxx(stdscr);
+    height = getmaxy(stdscr);
+
+    move(height - 1, 0);
+    clrtoeol();
+
+    if (status_count > 1) {
+        snprintf(buf, sizeof(buf), "%s (x%d)", status_msg, status_count);
+    } else {
+        snprintf(buf, sizeof(buf), "%s", status_msg);
+    }
+
+    len = strlen(buf);
+    if (len > width)
+        len = width;
+
+    mvaddnstr(height - 1, (width - len) / 2, buf, len);
+}
+
+static int
+draw_control(struct mixoss_control *ctrl, int py, int px, int selected) {
+    struct oss_mixext *ext;
+
+    const char *label;
+    int volume;
+    int nb_bars;
+    int indent;
+    int x, g;
+
+    ext = &ctrl->info;
+
+    /* Values changed by anyone are redrawn until the next dispatch */
+    if (!ui.needs_redraw[ext->ctrl] && !ctrl->changed)
+        return 0;
+
+    indent = ctrl->is_vmix ? 0 : 2 * get_control_depth(&mx->mixers[cur_dev],
+                                                       ctrl);
+    if (indent > label_padding)
+        indent = label_padding;
+
+    if (ext->type == MIXT_GROUP) {
+        int width = label_padding + gauge_width + 6 - indent - 4;
+
+        if (selected)
+            attron(A_BOLD);
+
+        mvprintw(py, px, "%*s[%c] %-*.*s", indent, "",
+                 is_collapsed(ctrl) ? '+' : '-', width, width, ext->id);
+
+        if (selected)
+            attroff(A_BOLD);
+
+        ui.needs_redraw[ext->ctrl] = 0;
+        return 0;
+    }
+
+    label = ext->id;
+    if (ctrl->is_vmix) {
+        const struct vmix_owner *owner = &ui.owners[ext->ctrl];
+        char buf[sizeof(owner->cmd) + 16];
+
+        if (*owner->label)
+            label = owner->label;
+
+        /* The owner goes on the line below the slider */
+        buf[0] = '\0';
+        if (*owner->cmd) {
+            snprintf(buf, sizeof(buf), "%s (%d)", owner->cmd, owner->pid);
+        } else if (owner->pid > 0) {
+            snprintf(buf, sizeof(buf), "pid %d", owner->pid);
+        }
+        mvprintw(py + 1, px + 2, "%-*.*s", label_padding + gauge_width + 4,
+                 label_padding + gauge_width + 4, buf);
+    }
+
+    volume = get_control_volume(ctrl);
+    nb_bars = (volume * gauge_width) / 100;
+
+    if (selected)
+        attron(A_BOLD);
+
+    x = px;
+    mvprintw(py, x, "%*s%-*.*s", indent, "", label_padding - indent,
+             label_padding - indent, label);
+
+    if (selected)
+        attroff(A_BOLD);
+
+    x += label_padding + 1;
+    for (g = 0; g < nb_bars; g++) {
+        mvaddch(py, x, '|');
+        x++;
+    }
+    for (; g < gauge_width; g++) {
+        mvaddch(py, x, ' ');
+        x++;
+    }
+
+    if (selected)
+        attron(A_BOLD);
+
+    x++;
+    mvprintw(py, x, "%3d%%", volume);
+
+    if (selected)
+        attroff(A_BOLD);
+
+    ui.needs_redraw[ext->ctrl] = 0;
+    return 0;
+}
+
+static void
+format_histogram(const struct mixoss_op_stats *stats, char *buf) {
+    static const char shades[] = " .:-=+*#%@";
+    unsigned long max;
+
+    max = 0;
+    for (int b = 0; b < MIXOSS_NB_STAT_BUCKETS; b++) {
+        if (stats->buckets[b] > max)
+            max = stats->buckets[b];
+    }
+
+    for (int b = 0; b < MIXOSS_NB_STAT_BUCKETS; b++) {
+        int shade;
+
+        shade = 0;
+        if (stats->buckets[b] > 0)
+            shade = 1 + (stats->buckets[b] * 8) / max;
+
+        buf[b] = shades[shade];
+    }
+    buf[MIXOSS_NB_STAT_BUCKETS] = '\0';
+}
+
+static void
+draw_stats() {
+    char hist[MIXOSS_NB_STAT_BUCKETS + 1];
+    struct mixoss_mixer *mixer;
+    int height;
+    int y;
+
+    mixer = &mx->mixers[cur_dev];
+    height = getmaxy(stdscr);
+
+    erase();
+    mvaddstr(0, (80 - strlen(title)) / 2, title);
+
+    y = 2;
+    attron(A_BOLD);
+    mvprintw(y++, 0, "%-12s %8s %6s %8s %8s  %s",
+             "request", "count", "errors", "avg us", "max us",
+             "latency (log2 us)");
+    attroff(A_BOLD);
+
+    for (int op = 0; op < MIXOSS_NB_OPS; op++) {
+        const struct mixoss_op_stats *stats = &mx->op_stats[op];
+
+        format_histogram(stats, hist);
+        mvprintw(y++, 0, "%-12s %8lu %6lu %8llu %8llu  [%s]",
+                 mixoss_op_names[op], stats->count, stats->errors,
+                 stats->count ? stats->total_us / stats->count : 0,
+                 stats->max_us, hist);
+    }
+
+    y++;
+    attron(A_BOLD);
+    mvprintw(y++, 0, "%-12s %-12s %8s %6s %8s %8s",
+             "control", "request", "count", "errors", "avg us", "max us");
+    attroff(A_BOLD);
+
+    for (int c = 0; c < mixer->nb_controls && y < height - 1; c++) {
+        struct mixoss_control *ctrl = &mixer->controls[c];
+
+        if (!ctrl->stats)
+            continue;
+
+        for (int op = 0; op < MIXOSS_NB_OPS && y < height - 1; op++) {
+            const struct mixoss_op_stats *stats = &ctrl->stats[op];
+
+            if (!stats->count)
+                continue;
+
+            mvprintw(y++, 0, "%-12.12s %-12s %8lu %6lu %8llu %8llu",
+                     ctrl->info.id, mixoss_op_names[op],
+                     stats->count, stats->errors,
+                     stats->total_us / stats->count, stats->max_us);
+        }
+    }
+
+    draw_status();
+    refresh();
+}
+
+static void
+draw_ui() {
+    struct mixoss_mixer *mixer;
+    int width, height;
+    int py_left, py_right;
+    int px;
+    int y_max;
+
+    mixer = &mx->mixers[cur_dev];
+    sync_ui_mixer(mixer);
+
+    if (stats_shown) {
+        draw_stats();
+        return;
+    }
+
+    width  = getmaxx(stdscr);
+    height = getmaxy(stdscr);
+
+    mvaddstr(0, (80 - strlen(title)) / 2, title);
+
+    if (!mixer->info.enabled) {
+        mvprintw(2, 0, "mixer '%s' is disabled", mixer->info.name);
+        draw_status();
+        refresh();
+        return;
+    }
+
+    if (mixer->health != MIXOSS_OK) {
+        mvprintw(2, 0, "mixer '%s' is %s, next attempt in %d ms",
+                 mixer->info.name, mixoss_health_names[mixer->health],
+                 mixer->backoff);
+        draw_status();
+        refresh();
+        return;
+    }
+
+    py_left = 2;
+    for (int i = 0; i < ui.nb_dev_sliders; i++) {
+        px = 0;
+
+        if (searching && !ui.matched[i])
+            continue;
+
+        if (draw_control(ui.sliders[i], py_left, px, i == ui.curr) == 0)
+            py_left++;
+    }
+
+    py_right = 2;
+    px = 1 + label_padding + 2 + gauge_width + 1 + 6;
+    for (int i = ui.nb_dev_sliders; i < ui.nb_sliders; i++) {
+        if (searching && !ui.matched[i])
+            continue;
+
+        if (draw_control(ui.sliders[i], py_right, px, i == ui.curr) == 0)
+            py_right += 2;
+    }
+
+    if (ui.nb_idle_vmix > 0) {
+        mvprintw(py_right, px, "%d idle channel%s", ui.nb_idle_vmix,
+                 ui.nb_idle_vmix > 1 ? "s" : "");
+        py_right++;
+    }
+
+    y_max = py_left > py_right ? py_left : py_right;
+    for (int y = 2; y < y_max; y++)
+        mvaddch(y, 40, ACS_VLINE);
+
+    draw_status();
+    refresh();
+}
+
+static void
+toggle_stats() {
+    stats_shown = !stats_shown;
+
+    /* Collection starts the first time the overlay is shown and stays on,
+     * so that the numbers keep accumulating while it is hidden. */
+    if (stats_shown)
+        mixoss_enable_stats(mx);
+
+    clear();
+    memset(ui.needs_redraw, 1, ui.nb_controls);
+    draw_ui();
+}
+
+static void
+dump_stats() {
+    fprintf(stderr, "%-12s %8s %6s %8s %8s\n",
+            "request", "count", "errors", "avg us", "max us");
+
+    for (int op = 0; op < MIXOSS_NB_OPS; op++) {
+        const struct mixoss_op_stats *stats = &mx->op_stats[op];
+        unsigned long long limit;
+
+        if (!stats->count)
+            continue;
+
+        fprintf(stderr, "%-12s %8lu %6lu %8llu %8llu\n",
+                mixoss_op_names[op], stats->count, stats->errors,
+                stats->total_us / stats->count, stats->max_us);
+
+        limit = 1;
+        for (int b = 0; b < MIXOSS_NB_STAT_BUCKETS; b++, limit <<= 1) {
+            if (!stats->buckets[b])
+                continue;
+
+            if (b < MIXOSS_NB_STAT_BUCKETS - 1) {
+                fprintf(stderr, "    < %8llu us: %lu\n",
+                        limit, stats->buckets[b]);
+            } else {
+                fprintf(stderr, "    >= %7llu us: %lu\n",
+                        limit >> 1, stats->buckets[b]);
+            }
+        }
+    }
+
+    fputc('\n', stderr);
+    fprintf(stderr, "%-16s %-12s %-12s %8s %6s %8s %8s\n",
+            "mixer", "control", "request",
+            "count", "errors", "avg us", "max us");
+
+    for (int m = 0; m < mx->nb_mixers; m++) {
+        struct mixoss_mixer *mixer = &mx->mixers[m];
+
+        for (int c = 0; c < mixer->nb_controls; c++) {
+            struct mixoss_control *ctrl = &mixer->controls[c];
+
+            if (!ctrl->stats)
+                continue;
+
+            for (int op = 0; op < MIXOSS_NB_OPS; op++) {
+                const struct mixoss_op_stats *stats = &ctrl->stats[op];
+
+                if (!stats->count)
+                    continue;
+
+                fprintf(stderr, "%-16.16s %-12.12s %-12s "
+                        "%8lu %6lu %8llu %8llu\n",
+                        mixer->info.name, ctrl->info.id, mixoss_op_names[op],
+                        stats->count, stats->errors,
+                        stats->total_us / stats->count, stats->max_us);
+            }
+        }
+    }
+}
+
+static void
+select_slider(int idx) {
+    if (ui.curr >= 0)
+        ui.needs_redraw[ui.sliders[ui.curr]->info.ctrl] = 1;
+
+    ui.curr = idx;
+    ui.needs_redraw[ui.sliders[idx]->info.ctrl] = 1;
+    strcpy(ui.selected_id, ui.sliders[idx]->info.id);
+
+    draw_ui();
+}
+
+static void
+move_to_next_control() {
+    /* Device sliders come first, so this goes on with the vmix ones */
+    if (ui.curr >= 0 && ui.curr + 1 < ui.nb_sliders)
+        select_slider(ui.curr + 1);
 }
 
 static void
 move_to_previous_control() {
-    struct control *curr, *prev;
+    if (ui.curr > 0)
+        select_slider(ui.curr - 1);
+}
+
+static void
+toggle_collapse() {
+    struct mixoss_mixer *mixer = &mx->mixers[cur_dev];
+    struct mixoss_control *group;
+    char name[CONTROL_NAME_SIZE];
+    int i;
+
+    if (ui.curr < 0 || ui.sliders[ui.curr]->is_vmix)
+        return;
+
+    /* On a slider, its own group is collapsed */
+    group = ui.sliders[ui.curr];
+    if (group->info.type != MIXT_GROUP)
+        group = get_parent_group(mixer, group);
+    if (!group)
+        return;
+
+    mixoss_format_name(group, name, sizeof(name));
+
+    for (i = 0; i < nb_collapsed_groups; i++) {
+        if (strcmp(collapsed_groups[i], name) == 0)
+            break;
+    }
+
+    if (i < nb_collapsed_groups) {
+        nb_collapsed_groups--;
+        memmove(&collapsed_groups[i], &collapsed_groups[i + 1],
+                (nb_collapsed_groups - i) * sizeof(*collapsed_groups));
+    } else {
+        void *names;
+
+        names = realloc(collapsed_groups, (nb_collapsed_groups + 1)
+                                          * sizeof(*collapsed_groups));
+        if (!names) {
+            set_ui_error("cannot collapse group: %s", strerror(errno));
+            return;
+        }
+        collapsed_groups = names;
+        strcpy(collapsed_groups[nb_collapsed_groups++], name);
+    }
+
+    /* The selection stays on the group, which is the only thing left of
+     * it once collapsed */
+    snprintf(ui.selected_id, sizeof(ui.selected_id), "%s", group->info.id);
+    ui.needs_layout = 1;
+    draw_ui();
+}
+
+static void
+expand_parent_groups(struct mixoss_mixer *mixer,
+                     const struct mixoss_control *ctrl) {
+    struct mixoss_control *group;
+    char name[CONTROL_NAME_SIZE];
+
+    /* Bounded, see is_control_hidden() */
+    group = get_parent_group(mixer, ctrl);
+    for (int i = 0; group && i < mixer->nb_controls; i++) {
+        mixoss_format_name(group, name, sizeof(name));
+
+        for (int g = 0; g < nb_collapsed_groups; g++) {
+            if (strcmp(collapsed_groups[g], name) == 0) {
+                nb_collapsed_groups--;
+                memmove(&collapsed_groups[g], &collapsed_groups[g + 1],
+                        (nb_collapsed_groups - g)
+                        * sizeof(*collapsed_groups));
+                break;
+            }
+        }
+
+        group = get_parent_group(mixer, group);
+    }
+}
+
+static int
+match_search() {
+    int best, best_score;
+
+    best = -1;
+    best_score = -1;
+    for (int i = 0; i < ui.nb_sliders; i++) {
+        int score;
+
+        score = fuzzy_score(ui.search_keys[i], search_query);
+        ui.matched[i] = score >= 0;
+
+        /* Ties keep the current selection, e.g. on an empty query */
+        if (score > best_score
+         || (score >= 0 && score == best_score && i == ui.curr)) {
+            best = i;
+            best_score = score;
+        }
+    }
+
+    return best;
+}
+
+static void
+run_search() {
+    int best;
+
+    best = match_search();
+
+    set_ui_error(NULL);
+    set_ui_error("/%s", search_query);
+
+    /* The filtered list moves everything around */
+    clear();
+    memset(ui.needs_redraw, 1, ui.nb_controls);
+
+    if (best >= 0) {
+        select_slider(best);
+    } else {
+        draw_ui();
+    }
+}
+
+static void
+start_search() {
+    if (ui.curr < 0)
+        return;
+
+    searching = 1;
+    search_len = 0;
+    search_query[0] = '\0';
+    strcpy(search_prev_id, ui.selected_id);
+
+    /* Hidden controls are laid out for the search */
+    ui.needs_layout = 1;
+    sync_ui_mixer(&mx->mixers[cur_dev]);
+    run_search();
+}
+
+static void
+stop_search(int keep) {
+    struct mixoss_mixer *mixer = &mx->mixers[cur_dev];
+
+    searching = 0;
+    set_ui_error(NULL);
+
+    /* A control found in a collapsed group stays in sight */
+    if (keep && ui.curr >= 0) {
+        expand_parent_groups(mixer, ui.sliders[ui.curr]);
+    } else if (!keep) {
+        strcpy(ui.selected_id, search_prev_id);
+    }
+
+    ui.needs_layout = 1;
+    draw_ui();
+}
+
+static void
+handle_search_key(int c) {
+    switch (c) {
+        case '\r':
+        case '\n':
+        case KEY_ENTER:
+            stop_search(1);
+            return;
+
+        case 27: /* escape */
+            stop_search(0);
+            return;
+
+        case KEY_BACKSPACE:
+        case 127:
+        case '\b':
+            if (search_len == 0)
+                return;
+            search_query[--search_len] = '\0';
+            break;
+
+        default:
+            if (c > 0xff || !isprint(c)
+             || search_len + 1 >= (int)sizeof(search_query)) {
+                return;
+            }
+            search_query[search_len++] = tolower(c);
+            search_query[search_len] = '\0';
+            break;
+    }
+
+    run_search();
+}
+
+static void
+set_linked_volume(struct mixoss_control *ctrl, int volume) {
+    struct group *group;
+
+    group = groups_linked ? find_group(ctrl) : NULL;
+    if (group) {
+        set_group_volume(group, ctrl, volume);
+    } else {
+        set_control_volume(ctrl, volume);
+    }
+
+    draw_ui();
+}
+
+static void
+modify_volume(int sign) {
+    struct mixoss_control *ctrl;
+    int volume;
+    int inc;
+
+    if (ui.curr < 0 || ui.sliders[ui.curr]->info.type == MIXT_GROUP)
+        return;
+
+    ctrl = ui.sliders[ui.curr];
+    inc = sign * (100 / gauge_width);
+
+    /* Relative to the target of a fade in flight, so that repeated keys
+     * add up */
+    volume = get_target_volume(ctrl) + inc;
+
+    if (volume < 0) {
+        volume = 0;
+    } else if (volume > 100) {
+        volume = 100;
+    }
+
+    set_linked_volume(ctrl, volume);
+}
+
+static void
+set_volume(int volume) {
+    struct mixoss_control *ctrl;
+
+    if (ui.curr < 0 || ui.sliders[ui.curr]->info.type == MIXT_GROUP)
+        return;
+
+    ctrl = ui.sliders[ui.curr];
+
+    if (volume < 0) {
+        volume = 0;
+    } else if (volume > 100) {
+        volume = 100;
+    }
+
+    set_linked_volume(ctrl, volume);
+}
+
+static void
+toggle_groups() {
+    groups_linked = !groups_linked;
+    set_ui_error("groups %s", groups_linked ? "linked" : "unlinked");
+}
+
+static int
+open_fifo() {
+    struct stat st;
+
+    if (mkfifo(fifo_path, 0600) == 0) {
+        fifo_created = 1;
+    } else if (errno != EEXIST) {
+        fprintf(stderr, "cannot create %s: %s\n", fifo_path, strerror(errno));
+        return -1;
+    }
+
+    /* Opened for writing as well, so that the last writer going away
+     * does not leave the fifo at end of file */
+    fifo_fd = open(fifo_path, O_RDWR | O_NONBLOCK);
+    if (fifo_fd == -1) {
+        fprintf(stderr, "cannot open %s: %s\n", fifo_path, strerror(errno));
+        close_fifo();
+        return -1;
+    }
+    mixoss_set_cloexec(fifo_fd);
+
+    /* An existing path could be anything, e.g. a file whose lines would
+     * be taken as commands */
+    if (fstat(fifo_fd, &st) == -1 || !S_ISFIFO(st.st_mode)) {
+        fprintf(stderr, "%s is not a fifo\n", fifo_path);
+        close_fifo();
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+close_fifo() {
+    if (fifo_fd >= 0)
+        close(fifo_fd);
+    fifo_fd = -1;
+
+    if (fifo_created)
+        unlink(fifo_path);
+    fifo_created = 0;
+}
+
+static void
+read_fifo() {
+    char *line, *nl;
+    ssize_t n;
+
+    n = read(fifo_fd, fifo_in + fifo_in_len, sizeof(fifo_in) - fifo_in_len);
+    if (n <= 0)
+        return;
+    fifo_in_len += n;
+
+    line = fifo_in;
+    while ((nl = memchr(line, '\n', fifo_in_len - (line - fifo_in)))) {
+        *nl = '\0';
+        run_fifo_command(line);
+        line = nl + 1;
+    }
+
+    fifo_in_len -= line - fifo_in;
+    memmove(fifo_in, line, fifo_in_len);
+
+    if (fifo_in_len == sizeof(fifo_in)) {
+        set_ui_error("fifo: line too long");
+        fifo_in_len = 0;
+    }
+}
+
+static struct mixoss_control *
+find_mute_control(struct mixoss_control *ctrl) {
+    char name[CONTROL_NAME_SIZE + 8];
+
+    if (ctrl->info.type == MIXT_ONOFF || ctrl->info.type == MIXT_MUTE)
+        return ctrl;
+
+    /* Drivers name the switch of a slider after it, e.g. line.mute */
+    mixoss_format_name(ctrl, name, sizeof(name));
+    strcat(name, ".mute");
+    return mixoss_lookup(mx, name);
+}
+
+static void
+run_fifo_command(char *line) {
+    struct mixoss_control *ctrl;
+    char *cmd, *name, *arg;
+    int left, right;
+
+    /* inc|dec <control> [<n>], set <control> <value>, mute|unmute
+     * <control> */
+    cmd = strtok(line, " \t\r");
+    name = strtok(NULL, " \t\r");
+    arg = strtok(NULL, " \t\r");
+    if (!cmd)
+        return;
+
+    ctrl = name ? mixoss_lookup(mx, name) : NULL;
+    if (!ctrl) {
+        set_ui_error("fifo: unknown control '%s'", name ? name : "");
+        return;
+    }
+
+    if (strcmp(cmd, "inc") == 0 || strcmp(cmd, "dec") == 0) {
+        int step;
+
+        if (!is_slider(ctrl)) {
+            set_ui_error("fifo: '%s' is not a slider", name);
+            return;
+        }
+
+        step = arg ? atoi(arg) : 5;
+        if (strcmp(cmd, "dec") == 0)
+            step = -step;
+
+        refresh_control(ctrl);
+
+        /* Relative to the target of a fade in flight, as keys are */
+        get_target_levels(ctrl, &left, &right);
+        left += step;
+        right += step;
+        left = left < 0 ? 0 : left > 100 ? 100 : left;
+        right = right < 0 ? 0 : right > 100 ? 100 : right;
+    } else if (strcmp(cmd, "set") == 0) {
+        if (!arg || mixoss_parse_value(ctrl, arg, &left, &right) == -1) {
+            set_ui_error("fifo: invalid value for '%s'", name);
+            return;
+        }
+    } else if (strcmp(cmd, "mute") == 0 || strcmp(cmd, "unmute") == 0) {
+        ctrl = find_mute_control(ctrl);
+        if (!ctrl) {
+            set_ui_error("fifo: no mute switch for '%s'", name);
+            return;
+        }
+
+        left = strcmp(cmd, "mute") == 0;
+        right = left;
+    } else {
+        set_ui_error("fifo: unknown command '%s'", cmd);
+        return;
+    }
+
+    /* Same path as the keys: cached values, a single write, and the
+     * screen updated right away */
+    if (is_slider(ctrl) && left == right) {
+        set_linked_volume(ctrl, left);
+    } else {
+        fade_control(ctrl, left, right, fade_duration);
+        mixoss_flush(mx);
+        draw_ui();
+    }
+}
+
+static struct mixoss_control *
+resolve_control(const char *name) {
+    struct mixoss_mixer *mixer;
+    struct mixoss_control *ctrl;
+    const char *id;
+
+    mixer = mixoss_find_control_mixer(mx, name, &id);
+    if (!mixer) {
+        fprintf(stderr, "unknown mixer in '%s'\n", name);
+        return NULL;
+    }
+
+    /* Only the mixers which are actually used get enumerated */
+    if (!mixer->controls && mixer->info.enabled) {
+        if (mixoss_load_mixer(mx, mixer) == -1) {
+            fprintf(stderr, "cannot load controls of mixer '%s': %s\n",
+                    mixer->info.name, strerror(errno));
+            return NULL;
+        }
+    }
+
+    ctrl = mixoss_find_control(mx, mixer, id);
+    if (!ctrl && errno == EEXIST) {
+        fprintf(stderr, "ambiguous control '%s', name it by #index\n",
+                name);
+    } else if (!ctrl) {
+        fprintf(stderr, "unknown control '%s'\n", name);
+    }
+
+    return ctrl;
+}
+
+static FILE *
+create_temp_file(const char *path, char *tmp_path, size_t size) {
+    snprintf(tmp_path, size, "%s.%ld", path, (long)getpid());
+    return fopen(tmp_path, "w");
+}
+
+static int
+commit_temp_file(FILE *fp, const char *tmp_path, const char *path) {
+    int failed;
+    int err;
+
+    /* The file is renamed over the previous one only once it is complete,
+     * so that readers never see a partial file. */
+    failed = ferror(fp);
+    if (fclose(fp) != 0)
+        failed = 1;
+
+    if (!failed && rename(tmp_path, path) == 0)
+        return 0;
+
+    err = errno;
+    unlink(tmp_path);
+    errno = err;
+    return -1;
+}
+
+static void
+get_map_path() {
+    static char path[1024];
+    const char *dir;
+
+    if (map_path)
+        return;
+
+    dir = getenv("XDG_CACHE_HOME");
+    if (dir && *dir) {
+        snprintf(path, sizeof(path), "%s/mixoss.map", dir);
+    } else if ((dir = getenv("HOME")) && *dir) {
+        snprintf(path, sizeof(path), "%s/.cache/mixoss.map", dir);
+    } else {
+        return;
+    }
+
+    map_path = path;
+}
+
+static int
+load_control_map() {
+    char line[256];
+    FILE *fp;
+
+    get_map_path();
+    if (!map_path)
+        return -1;
+
+    fp = fopen(map_path, "r");
+    if (!fp)
+        return -1;
+
+    while (fgets(line, sizeof(line), fp)) {
+        struct map_entry *entry;
+        char *fields[7];
+        char *ptr;
+        int n;
+
+        line[strcspn(line, "\n")] = '\0';
+
+        /* dev ctrl timestamp mixer-name mixer-id id extname */
+        ptr = line;
+        for (n = 0; n < 7 && ptr; n++) {
+            fields[n] = ptr;
+            ptr = strchr(ptr, '\t');
+            if (ptr)
+                *ptr++ = '\0';
+        }
+        if (n < 7)
+            continue;
+
+        if (nb_map_entries % 64 == 0) {
+            struct map_entry *entries;
+
+            entries = realloc(map_entries,
+                              (nb_map_entries + 64) * sizeof(*entries));
+            if (!entries)
+                break;
+            map_entries = entries;
+        }
+
+        entry = &map_entries[nb_map_entries++];
+        memset(entry, 0, sizeof(*entry));
+
+        entry->dev = atoi(fields[0]);
+        entry->ctrl = atoi(fields[1]);
+        entry->timestamp = atoi(fields[2]);
+        snprintf(entry->mixer_name, sizeof(entry->mixer_name),
+                 "%s", fields[3]);
+        snprintf(entry->mixer_id, sizeof(entry->mixer_id), "%s", fields[4]);
+        snprintf(entry->id, sizeof(entry->id), "%s", fields[5]);
+        snprintf(entry->extname, sizeof(entry->extname), "%s", fields[6]);
+    }
+
+    fclose(fp);
+    return nb_map_entries > 0 ? 0 : -1;
+}
+
+static void
+save_control_map() {
+    char tmp_path[1100];
+    char dir[1024];
+    char *sep;
+    FILE *fp;
+
+    if (!map_path)
+        return;
+
+    snprintf(dir, sizeof(dir), "%s", map_path);
+    sep = strrchr(dir, '/');
+    if (sep) {
+        *sep = '\0';
+        mkdir(dir, 0755);
+    }
+
+    fp = create_temp_file(map_path, tmp_path, sizeof(tmp_path));
+    if (!fp)
+        return;
+
+    /* Entries of the mixers which were not enumerated this time are kept
+     * from the previous map. */
+    for (int e = 0; e < nb_map_entries; e++) {
+        struct map_entry *entry = &map_entries[e];
+
+        if (entry->dev < mx->nb_mixers && mx->mixers[entry->dev].controls)
+            continue;
+
+        fprintf(fp, "%d\t%d\t%d\t%s\t%s\t%s\t%s\n",
+                entry->dev, entry->ctrl, entry->timestamp,
+                entry->mixer_name, entry->mixer_id,
+                entry->id, entry->extname);
+    }
+
+    for (int m = 0; m < mx->nb_mixers; m++) {
+        struct mixoss_mixer *mixer = &mx->mixers[m];
+
+        for (int c = 0; c < mixer->nb_controls; c++) {
+            struct oss_mixext *ext = &mixer->controls[c].info;
+
+            if (!*ext->id)
+                continue;
+
+            fprintf(fp, "%d\t%d\t%d\t%s\t%s\t%s\t%s\n",
+                    m, c, ext->timestamp,
+                    mixer->info.name, mixer->info.id,
+                    ext->id, ext->extname);
+        }
+    }
+
+    commit_temp_file(fp, tmp_path, map_path);
+}
+
+static void
+free_control_map() {
+    for (int e = 0; e < nb_map_entries; e++) {
+        if (map_entries[e].ctrl_data) {
+            free(map_entries[e].ctrl_data->stats);
+            free(map_entries[e].ctrl_data);
+        }
+    }
+
+    free(map_entries);
+    map_entries = NULL;
+    nb_map_entries = 0;
+}
+
+static struct map_entry *
+find_map_entry(const char *name) {
+    struct map_entry *found;
+    const char *sep, *id;
+    size_t len;
+    char *end;
+    long dev;
+
+    sep = strchr(name, ':');
+    if (sep) {
+        len = sep - name;
+        id = sep + 1;
+    } else {
+        len = 0;
+        id = name;
+    }
+
+    dev = sep ? strtol(name, &end, 10) : 0;
+    if (sep && (len == 0 || end != sep))
+        dev = -1;
+
+    /* An ambiguous id goes through the slow path, which reports it */
+    found = NULL;
+    for (int e = 0; e < nb_map_entries; e++) {
+        struct map_entry *entry = &map_entries[e];
+
+        if (dev >= 0) {
+            if (entry->dev != dev)
+                continue;
+        } else if ((strlen(entry->mixer_name) != len
+                 || strncmp(entry->mixer_name, name, len) != 0)
+                && (strlen(entry->mixer_id) != len
+                 || strncmp(entry->mixer_id, name, len) != 0)) {
+            continue;
+        }
+
+        if (id[0] == '#') {
+            if (entry->ctrl == atoi(id + 1))
+                return entry;
+        } else if (strcmp(entry->id, id) == 0
+                || strcmp(entry->extname, id) == 0) {
+            if (found)
+                return NULL;
+            found = entry;
+        }
+    }
+
+    return found;
+}
+
+static int
+resolve_cli_ops_fast() {
+    int max_dev;
+
+    /* The mixers get no control at all, only the ones used by the
+     * operations are looked up, with a single SNDCTL_MIX_EXTINFO each. */
+    max_dev = -1;
+    for (int i = 0; i < nb_cli_ops; i++) {
+        struct map_entry *entry;
+
+        entry = find_map_entry(cli_ops[i].name);
+        if (!entry)
+            return -1;
+
+        cli_ops[i].entry = entry;
+        if (entry->dev > max_dev)
+            max_dev = entry->dev;
+    }
+
+    if (mixoss_init_mixers(mx, max_dev + 1) == -1)
+        return -1;
+
+    for (int i = 0; i < nb_cli_ops; i++) {
+        struct map_entry *entry = cli_ops[i].entry;
+        struct mixoss_control *ctrl;
+        struct mixoss_mixer *mixer;
+
+        mixer = &mx->mixers[entry->dev];
+        mixer->info.dev = entry->dev;
+        mixer->info.enabled = 1;
+        snprintf(mixer->info.name, sizeof(mixer->info.name),
+                 "%s", entry->mixer_name);
+        snprintf(mixer->info.id, sizeof(mixer->info.id),
+                 "%s", entry->mixer_id);
+
+        if (!entry->ctrl_data) {
+            ctrl = calloc(1, sizeof(struct mixoss_control));
+            if (!ctrl)
+                return -1;
+            entry->ctrl_data = ctrl;
+
+            ctrl->info.dev = entry->dev;
+            ctrl->info.ctrl = entry->ctrl;
+
+            /* The timestamp changes whenever the driver changes its
+             * controls, so a matching one proves the map is still valid.
+             * A stale entry is not a device failure, hence no health
+             * tracking. */
+            if (mixoss_raw_ioctl(mx, MIXOSS_OP_EXTINFO, ctrl,
+                                 SNDCTL_MIX_EXTINFO, &ctrl->info) == -1
+             || ctrl->info.timestamp != entry->timestamp
+             || strcmp(ctrl->info.id, entry->id) != 0) {
+                return -1;
+            }
+        }
+
+        cli_ops[i].ctrl = entry->ctrl_data;
+    }
+
+    return 0;
+}
+
+static int
+run_cli() {
+    int status;
+
+    status = 0;
+
+    if (load_control_map() == 0 && resolve_cli_ops_fast() == 0) {
+        status = apply_cli_ops();
+        free_control_map();
+        return status;
+    }
+
+    /* Slow path: enumerate the mixers which are referenced and refresh
+     * the map for the next time */
+    mixoss_free_mixers(mx);
+    for (int i = 0; i < nb_cli_ops; i++)
+        cli_ops[i].ctrl = NULL;
+
+    if (mixoss_load_infos(mx) == -1) {
+        free_control_map();
+        return 1;
+    }
+
+    for (int i = 0; i < nb_cli_ops; i++) {
+        cli_ops[i].ctrl = resolve_control(cli_ops[i].name);
+        if (!cli_ops[i].ctrl)
+            status = 1;
+    }
+
+    save_control_map();
+    free_control_map();
+
+    if (status != 0)
+        return status;
+
+    return apply_cli_ops();
+}
+
+static int
+apply_cli_ops() {
+    int status;
+
+    status = 0;
+
+    /* Everything is resolved and checked before the first write, so that
+     * a typo does not leave the mixer half configured. */
+    for (int i = 0; i < nb_cli_ops; i++) {
+        struct cli_op *op = &cli_ops[i];
+        int left, right;
+
+        if (mixoss_decode_value(op->ctrl, 0, &left, &right) == 0) {
+            fprintf(stderr, "control '%s' has no value\n", op->name);
+            status = 1;
+            continue;
+        }
+
+        if (!op->values)
+            continue;
+
+        if (!(op->ctrl->info.flags & MIXF_WRITEABLE)) {
+            fprintf(stderr, "control '%s' is read-only\n", op->name);
+            status = 1;
+            continue;
+        }
+
+        if (mixoss_parse_value(op->ctrl, op->values, &left, &right) == -1) {
+            fprintf(stderr, "invalid value for control '%s': '%s'\n",
+                    op->name, op->values);
+            status = 1;
+            continue;
+        }
+
+        /* A fade starts from the current value */
+        if (fade_duration > 0 && mixoss_read(mx, op->ctrl) == -1) {
+            fprintf(stderr, "cannot get '%s': %s\n",
+                    op->name, strerror(errno));
+            status = 1;
+            continue;
+        }
+
+        fade_control(op->ctrl, left, right, fade_duration);
+    }
+
+    if (status != 0)
+        return status;
+
+    mixoss_flush(mx);
+    wait_for_ramps();
+
+    for (int i = 0; i < nb_cli_ops; i++) {
+        struct cli_op *op = &cli_ops[i];
+
+        if (op->values && op->ctrl->write_error) {
+            fprintf(stderr, "cannot set '%s': %s\n",
+                    op->name, strerror(op->ctrl->write_error));
+            op->ctrl->write_error = 0;
+            status = 1;
+        }
+    }
+
+    for (int i = 0; i < nb_cli_ops; i++) {
+        struct cli_op *op = &cli_ops[i];
+        char value[32];
+
+        if (op->values)
+            continue;
+
+        if (mixoss_read(mx, op->ctrl) == -1) {
+            fprintf(stderr, "cannot get '%s': %s\n",
+                    op->name, strerror(errno));
+            status = 1;
+            continue;
+        }
+
+        mixoss_format_value(op->ctrl, value, sizeof(value));
+        printf("%s=%s\n", op->name, value);
+    }
+
+    return status;
+}
+
+static int
+run_store(const char *path) {
+    char tmp_path[1100];
+    int status;
+    FILE *fp;
+
+    fp = create_temp_file(path, tmp_path, sizeof(tmp_path));
+    if (!fp) {
+        fprintf(stderr, "cannot create %s: %s\n", tmp_path, strerror(errno));
+        return 1;
+    }
+
+    fputs("# mixoss state 1\n", fp);
+    fputs("# mixer control value\n", fp);
+
+    status = 0;
+    for (int m = 0; m < mx->nb_mixers; m++) {
+        struct mixoss_mixer *mixer = &mx->mixers[m];
+
+        for (int c = 0; c < mixer->nb_controls; c++) {
+            struct mixoss_control *ctrl = &mixer->controls[c];
+
+            if (!mixoss_is_value_control(ctrl))
+                continue;
+
+            if (mixoss_read(mx, ctrl) == -1) {
+                fprintf(stderr, "cannot read %s:%s: %s\n",
+                        mixer->info.name, ctrl->info.id, strerror(errno));
+                status = 1;
+                continue;
+            }
+
+            fprintf(fp, "%s\t%s\t%d\n",
+                    mixer->info.name, ctrl->info.id, ctrl->value);
+        }
+    }
+
+    if (commit_temp_file(fp, tmp_path, path) == -1) {
+        fprintf(stderr, "cannot write %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    return status;
+}
+
+static int
+run_restore(const char *path) {
+    char line[256];
+    char *restored; /* by control, all mixers one after the other */
+    int nb_controls;
+    int nb_lines;
+    int status;
+    FILE *fp;
+
+    nb_controls = 0;
+    for (int m = 0; m < mx->nb_mixers; m++)
+        nb_controls += mx->mixers[m].nb_controls;
+
+    restored = calloc(nb_controls + 1, 1);
+    if (!restored) {
+        perror("cannot allocate controls");
+        return 1;
+    }
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+        free(restored);
+        return 1;
+    }
+
+    status = 0;
+    nb_lines = 0;
+
+    while (fgets(line, sizeof(line), fp)) {
+        struct mixoss_mixer *mixer;
+        struct mixoss_control *ctrl;
+        char *name, *id, *value;
+        char *end;
+        int base;
+        int v;
+
+        nb_lines++;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+
+        line[strcspn(line, "\n")] = '\0';
+
+        name = line;
+        id = strchr(name, '\t');
+        value = id ? strchr(id + 1, '\t') : NULL;
+        if (!value) {
+            fprintf(stderr, "%s:%d: invalid line\n", path, nb_lines);
+            status = 1;
+            continue;
+        }
+        *id++ = '\0';
+        *value++ = '\0';
+
+        v = strtol(value, &end, 10);
+        if (end == value || *end != '\0') {
+            fprintf(stderr, "%s:%d: invalid value\n", path, nb_lines);
+            status = 1;
+            continue;
+        }
+
+        mixer = mixoss_find_mixer(mx, name, strlen(name));
+        if (!mixer || !mixer->controls) {
+            fprintf(stderr, "%s:%d: mixer '%s' not available\n",
+                    path, nb_lines, name);
+            status = 1;
+            continue;
+        }
+
+        /* Ids are not always unique: each line takes the first control
+         * with that id which was not restored yet. */
+        base = 0;
+        for (int m = 0; m < mixer->info.dev; m++)
+            base += mx->mixers[m].nb_controls;
+
+        ctrl = NULL;
+        for (int c = 0; c < mixer->nb_controls; c++) {
+            struct mixoss_control *cur = &mixer->controls[c];
+
+            if (!restored[base + c] && strcmp(cur->info.id, id) == 0) {
+                ctrl = cur;
+                break;
+            }
+        }
+
+        if (!ctrl || !mixoss_is_value_control(ctrl)) {
+            fprintf(stderr, "%s:%d: unknown control '%s:%s'\n",
+                    path, nb_lines, name, id);
+            status = 1;
+            continue;
+        }
+        restored[base + ctrl->info.ctrl] = 1;
+
+        if (!(ctrl->info.flags & MIXF_WRITEABLE))
+            continue;
+
+        /* Rewriting a value which did not change costs an ioctl and can
+         * be heard, so only the differences are written. */
+        if (mixoss_read(mx, ctrl) == 0 && ctrl->value == v)
+            continue;
+
+        mixoss_queue_write(mx, ctrl, v);
+    }
+
+    fclose(fp);
+    free(restored);
+
+    if (mixoss_flush(mx) > 0) {
+        for (int m = 0; m < mx->nb_mixers; m++) {
+            struct mixoss_mixer *mixer = &mx->mixers[m];
+
+            for (int c = 0; c < mixer->nb_controls; c++) {
+                struct mixoss_control *ctrl = &mixer->controls[c];
+
+                if (!ctrl->write_error)
+                    continue;
+
+                fprintf(stderr, "cannot restore %s:%s: %s\n",
+                        mixer->info.name, ctrl->info.id,
+                        strerror(ctrl->write_error));
+                ctrl->write_error = 0;
+            }
+        }
+        status = 1;
+    }
+
+    return status;
+}
+
+static void
+capture_scene(int slot) {
+    struct mixoss_mixer *mixer;
+    struct scene *scene;
+    int nb_values;
+
+    mixer = &mx->mixers[cur_dev];
+    scene = &scenes[slot];
+
+    free(scene->values);
+    scene->values = NULL;
+    scene->nb_values = 0;
+
+    nb_values = 0;
+    for (int c = 0; c < mixer->nb_controls; c++) {
+        struct mixoss_control *ctrl = &mixer->controls[c];
+
+        if (mixoss_is_value_control(ctrl)
+         && (ctrl->info.flags & MIXF_WRITEABLE)) {
+            nb_values++;
+        }
+    }
+
+    scene->values = calloc(nb_values, sizeof(struct scene_value));
+    if (!scene->values) {
+        set_ui_error("cannot allocate scene: %s", strerror(errno));
+        return;
+    }
+    scene->dev = mixer->info.dev;
+
+    /* The values of the current mixer are read again each time its modify
+     * counter changes, except for the controls of collapsed groups */
+    for (int c = 0; c < mixer->nb_controls; c++) {
+        struct mixoss_control *ctrl = &mixer->controls[c];
+        struct scene_value *value;
+
+        if (!mixoss_is_value_control(ctrl)
+         || !(ctrl->info.flags & MIXF_WRITEABLE)) {
+            continue;
+        }
+        refresh_control(ctrl);
+
+        value = &scene->values[scene->nb_values++];
+        value->ctrl = c;
+        strcpy(value->id, ctrl->info.id);
+        value->value = ctrl->value;
+    }
+
+    set_ui_error("scene %d saved (%d controls)", slot, scene->nb_values);
+}
+
+static void
+recall_scene(int slot) {
+    struct scene *scene;
+    struct mixoss_mixer *mixer;
+    int nb_changes;
+
+    scene = &scenes[slot];
+    if (!scene->values) {
+        set_ui_error("scene %d is empty", slot);
+        return;
+    }
+
+    mixer = &mx->mixers[scene->dev];
+    if (!mixer->controls) {
+        set_ui_error("mixer '%s' is not available", mixer->info.name);
+        return;
+    }
+
+    nb_changes = 0;
+    for (int v = 0; v < scene->nb_values; v++) {
+        struct scene_value *value = &scene->values[v];
+        struct mixoss_control *ctrl;
+
+        /* Indexes are only a hint, the mixer may have been reloaded */
+        ctrl = NULL;
+        if (value->ctrl < mixer->nb_controls
+         && strcmp(mixer->controls[value->ctrl].info.id, value->id) == 0) {
+            ctrl = &mixer->controls[value->ctrl];
+        } else {
+            ctrl = mixoss_find_control(mx, mixer, value->id);
+        }
+
+        if (ctrl)
+            refresh_control(ctrl);
+
+        /* A fade in flight would still move it away from the scene */
+        if (!ctrl || (ctrl->value == value->value && !find_ramp(ctrl)))
+            continue;
+
+        if (fade_duration > 0) {
+            int left, right;
+
+            mixoss_decode_value(ctrl, value->value, &left, &right);
+            fade_control(ctrl, left, right, fade_duration);
+        } else {
+            /* The raw value, not its levels, to restore it exactly */
+            cancel_ramp(ctrl);
+            mixoss_queue_write(mx, ctrl, value->value);
+        }
+        nb_changes++;
+    }
+
+    mixoss_flush(mx);
+
+    set_ui_error("scene %d recalled (%d controls changed)", slot, nb_changes);
+    draw_ui();
+}
+
+static int
+open_shm(unsigned int capacity) {
+    static char path[1024];
+    char tmp_path[1100];
+    struct mixoss_shm_header *nshm;
+    size_t size;
+    void *addr;
+    int fd;
+
+    if (!shm_path) {
+        mixoss_runtime_path(path, sizeof(path), "shm");
+        shm_path = path;
+    }
+
+    size = sizeof(struct mixoss_shm_header)
+         + capacity * sizeof(struct mixoss_shm_control);
+
+    /* The name is predictable: O_EXCL so that nothing planted there, e.g.
+     * a symbolic link, is ever followed. A leftover of a previous process
+     * with the same pid is removed once. */
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld", shm_path, (long)getpid());
+    fd = open(tmp_path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd == -1 && errno == EEXIST && unlink(tmp_path) == 0)
+        fd = open(tmp_path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd == -1) {
+        set_ui_error("cannot create %s: %s", tmp_path, strerror(errno));
+        return -1;
+    }
+
+    if (ftruncate(fd, size) == -1) {
+        set_ui_error("cannot resize %s: %s", tmp_path, strerror(errno));
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        set_ui_error("cannot map %s: %s", tmp_path, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+
+    nshm = addr;
+    nshm->magic = MIXOSS_SHM_MAGIC;
+    nshm->version = MIXOSS_SHM_VERSION;
+    nshm->capacity = capacity;
+
+    if (rename(tmp_path, shm_path) == -1) {
+        set_ui_error("cannot create %s: %s", shm_path, strerror(errno));
+        munmap(addr, size);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    if (shm) {
+        mixoss_memory_barrier();
+        shm->obsolete = 1;
+        munmap(shm, shm_size);
+    }
+
+    shm = nshm;
+    shm_size = size;
+    return 0;
+}
+
+static void
+close_shm() {
+    if (!shm)
+        return;
+
+    unlink(shm_path);
+    mixoss_memory_barrier();
+    shm->obsolete = 1;
+    munmap(shm, shm_size);
+    shm = NULL;
+}
+
+static void
+publish_state() {
+    unsigned int nb;
+
+    nb = 0;
+    for (int m = 0; m < mx->nb_mixers; m++) {
+        for (int c = 0; c < mx->mixers[m].nb_controls; c++)
+            nb += mixoss_is_value_control(&mx->mixers[m].controls[c]);
+    }
+
+    if (nb > shm->capacity && open_shm(2 * nb) == -1)
+        return;
+
+    shm->seq++;
+    mixoss_memory_barrier();
+
+    nb = 0;
+    for (int m = 0; m < mx->nb_mixers; m++) {
+        struct mixoss_mixer *mixer = &mx->mixers[m];
+
+        for (int c = 0; c < mixer->nb_controls; c++) {
+            struct mixoss_control *ctrl = &mixer->controls[c];
+            struct mixoss_shm_control *sctrl = &shm->controls[nb];
+
+            if (!mixoss_is_value_control(ctrl))
+                continue;
+
+            sctrl->dev = m;
+            sctrl->ctrl = c;
+            sctrl->ambiguous = ctrl->ambiguous;
+            memcpy(sctrl->id, ctrl->info.id, sizeof(sctrl->id));
+            memcpy(sctrl->extname, ctrl->info.extname, sizeof(sctrl->extname));
+            sctrl->value = ctrl->value;
+            sctrl->nb_channels = mixoss_decode_value(ctrl, ctrl->value,
+                                                     &sctrl->left,
+                                                     &sctrl->right);
+            nb++;
+        }
+    }
+    shm->nb_controls = nb;
+
+    mixoss_memory_barrier();
+    shm->seq++;
+}
+
+static int
+load_mirrors(const char *path) {
+    char line[256];
+    int nb_lines;
+    FILE *fp;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    nb_lines = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        struct mixoss_control *src, *dst;
+        char *source, *destination, *min, *max;
+        struct mirror *mirror;
+
+        nb_lines++;
+        if (line[0] == '#')
+            continue;
+
+        /* source destination [min max] */
+        source = strtok(line, " \t\n");
+        if (!source)
+            continue;
+        destination = strtok(NULL, " \t\n");
+        min = strtok(NULL, " \t\n");
+        max = strtok(NULL, " \t\n");
+
+        if (!destination || (min && !max)
+         || (min && (atoi(min) < 0 || atoi(min) > atoi(max)
+                  || atoi(max) > 100))) {
+            fprintf(stderr, "%s:%d: invalid mirror\n", path, nb_lines);
+            goto error;
+        }
+
+        src = mixoss_lookup(mx, source);
+        dst = mixoss_lookup(mx, destination);
+        if (!src || !dst
+         || !mixoss_is_value_control(src) || !mixoss_is_value_control(dst)) {
+            fprintf(stderr, "%s:%d: unknown control\n", path, nb_lines);
+            goto error;
+        }
+
+        /* Levels are mirrored in percent, anything else as raw values */
+        if (is_slider(src) != is_slider(dst)) {
+            fprintf(stderr, "%s:%d: cannot mirror %s onto %s\n",
+                    path, nb_lines, source, destination);
+            goto error;
+        }
+
+        mirror = realloc(mirrors, (nb_mirrors + 1) * sizeof(struct mirror));
+        if (!mirror) {
+            perror("cannot allocate mirrors");
+            goto error;
+        }
+        mirrors = mirror;
+
+        mirror = &mirrors[nb_mirrors++];
+        memset(mirror, 0, sizeof(*mirror));
+        mixoss_format_name(src, mirror->source, sizeof(mirror->source));
+        mixoss_format_name(dst, mirror->destination,
+                           sizeof(mirror->destination));
+        mirror->min = min ? atoi(min) : 0;
+        mirror->max = max ? atoi(max) : 100;
+    }
+
+    fclose(fp);
+    return 0;
+
+error:
+    fclose(fp);
+    free(mirrors);
+    mirrors = NULL;
+    nb_mirrors = 0;
+    return -1;
+}
+
+static int
+is_mirror_echo(const struct mixoss_control *ctrl, const char *destination) {
+    char name[CONTROL_NAME_SIZE];
+
+    mixoss_format_name(ctrl, name, sizeof(name));
+
+    for (int i = 0; i < nb_mirrors; i++) {
+        struct mirror *mirror = &mirrors[i];
+
+        if (!mirror->has_written
+         || strcmp(mirror->destination, name) != 0
+         || strcmp(mirror->source, destination) != 0) {
+            continue;
+        }
+
+        /* Only the first change seen after the write may be its echo,
+         * whatever the order of the rules */
+        mirror->has_written = 0;
+        return mirror->written == ctrl->value;
+    }
+
+    return 0;
+}
+
+static int
+run_mirrors() {
+    int nb_writes;
+
+    nb_writes = 0;
+
+    /* An echo shows up within the round following the write, a marker
+     * left any longer would swallow a later change of the user */
+    mirror_round++;
+    for (int i = 0; i < nb_mirrors; i++) {
+        if (mirror_round - mirrors[i].written_round > 1)
+            mirrors[i].has_written = 0;
+    }
+
+    for (int i = 0; i < nb_mirrors; i++) {
+        struct mirror *mirror = &mirrors[i];
+        struct mixoss_control *src, *dst;
+        int left, right, value;
+
+        src = mixoss_lookup(mx, mirror->source);
+        if (!src || !src->changed)
+            continue;
+
+        dst = mixoss_lookup(mx, mirror->destination);
+        if (!dst)
+            continue;
+
+        /* A value we wrote there ourselves must not be sent back where it
+         * came from: rounding would make the two controls chase each
+         * other forever. The same goes for a write still queued. */
+        if (src->pending || is_mirror_echo(src, mirror->destination))
+            continue;
+
+        mixoss_decode_value(src, src->value, &left, &right);
+        if (is_slider(src)) {
+            left = mirror->min + left * (mirror->max - mirror->min) / 100;
+            right = mirror->min + right * (mirror->max - mirror->min) / 100;
+        }
+
+        value = mixoss_encode_value(dst, left, right);
+        if (value == dst->value)
+            continue;
+
+        mixoss_queue_write(mx, dst, value);
+        mirror->written = value;
+        mirror->has_written = 1;
+        mirror->written_round = mirror_round;
+        nb_writes++;
+    }
+
+    if (nb_writes > 0)
+        mixoss_flush(mx);
+
+    return nb_writes;
+}
+
+static int
+load_ducks(const char *path) {
+    char line[256];
+    int nb_lines;
+    FILE *fp;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    nb_lines = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        char *trigger, *target, *amount, *duration;
+        struct duck *duck;
+
+        nb_lines++;
+        if (line[0] == '#')
+            continue;
+
+        /* trigger target amount duration */
+        trigger = strtok(line, " \t\n");
+        if (!trigger)
+            continue;
+        target = strtok(NULL, " \t\n");
+        amount = strtok(NULL, " \t\n");
+        duration = strtok(NULL, " \t\n");
+
+        if (!target || !amount || !duration
+         || atoi(amount) < 0 || atoi(amount) > 100 || atoi(duration) < 0) {
+            fprintf(stderr, "%s:%d: invalid rule\n", path, nb_lines);
+            goto error;
+        }
+
+        duck = realloc(ducks, (nb_ducks + 1) * sizeof(struct duck));
+        if (!duck) {
+            perror("cannot allocate ducking rules");
+            goto error;
+        }
+        ducks = duck;
+
+        /* Labels and controls come and go with the applications, they
+         * are only resolved when checking */
+        duck = &ducks[nb_ducks++];
+        memset(duck, 0, sizeof(*duck));
+        snprintf(duck->trigger, sizeof(duck->trigger), "%s", trigger);
+        snprintf(duck->target, sizeof(duck->target), "%s", target);
+        duck->amount = atoi(amount);
+        duck->duration = atoi(duration);
+    }
+
+    fclose(fp);
+    return 0;
+
+error:
+    fclose(fp);
+    free(ducks);
+    ducks = NULL;
+    nb_ducks = 0;
+    return -1;
+}
+
+static void
+scan_engines() {
+    struct engine *engine;
+    int nb_vmix;
+
+    nb_vmix = 0;
+    for (int m = 0; m < mx->nb_mixers; m++) {
+        for (int c = 0; c < mx->mixers[m].nb_controls; c++)
+            nb_vmix += mx->mixers[m].controls[c].is_vmix;
+    }
+
+    nb_engines = 0;
+    if (nb_vmix == 0)
+        return;
+
+    engine = realloc(engines, nb_vmix * sizeof(struct engine));
+    if (!engine)
+        return;
+    engines = engine;
+
+    /* One ENGINEINFO per vmix channel, whatever the number of rules */
+    for (int m = 0; m < mx->nb_mixers; m++) {
+        struct mixoss_mixer *mixer = &mx->mixers[m];
+
+        for (int c = 0; c < mixer->nb_controls; c++) {
+            struct mixoss_control *ctrl = &mixer->controls[c];
+            struct oss_audioinfo ainfo;
+
+            if (!ctrl->is_vmix)
+                continue;
+
+            ainfo.dev = ctrl->vmix_dev;
+            if (mixoss_ioctl(mx, MIXOSS_OP_ENGINEINFO, ctrl,
+                             SNDCTL_ENGINEINFO, &ainfo) < 0) {
+                continue;
+            }
+
+            engine = &engines[nb_engines];
+            engine->ctrl = ctrl;
+            memcpy(engine->label, ainfo.label, sizeof(engine->label));
+            engine->label[sizeof(engine->label) - 1] = '\0';
+            engine->busy = ainfo.busy != 0;
+            nb_engines++;
+        }
+    }
+}
+
+static struct engine *
+find_engine(const char *label) {
+    for (int i = 0; i < nb_engines; i++) {
+        if (strcmp(engines[i].label, label) == 0)
+            return &engines[i];
+    }
+
+    return NULL;
+}
+
+static int
+is_engine_busy(const char *label) {
+    /* Several engines may share a label, e.g. two calls */
+    for (int i = 0; i < nb_engines; i++) {
+        if (engines[i].busy && strcmp(engines[i].label, label) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+static void
+check_ducks(unsigned long long now) {
+    next_duck_check = now + duck_interval * 1000ULL;
+
+    scan_engines();
+
+    for (int i = 0; i < nb_ducks; i++) {
+        struct duck *duck = &ducks[i];
+        struct mixoss_control *ctrl;
+        struct engine *engine;
+        int busy, left, right;
+
+        busy = is_engine_busy(duck->trigger);
+        if (busy == duck->active)
+            continue;
+
+        /* Without its target, e.g. the application went away, a rule
+         * starts over: saved levels must not be applied later to another
+         * channel taking the same label */
+        engine = find_engine(duck->target);
+        ctrl = engine ? engine->ctrl : mixoss_lookup(mx, duck->target);
+        if (!ctrl || !is_slider(ctrl)) {
+            duck->active = 0;
+            continue;
+        }
+
+        if (busy) {
+            /* The cache may be stale: the target can be on a mixer which
+             * is not polled, or not polled itself */
+            if (mixoss_read(mx, ctrl) == -1)
+                continue;
+            get_target_levels(ctrl, &duck->saved_left, &duck->saved_right);
+            left = duck->saved_left * (100 - duck->amount) / 100;
+            right = duck->saved_right * (100 - duck->amount) / 100;
+        } else {
+            left = duck->saved_left;
+            right = duck->saved_right;
+        }
+
+        fade_control(ctrl, left, right, duck->duration);
+        duck->active = busy;
+    }
+
+    mixoss_flush(mx);
+}
+
+static int
+load_ceilings(const char *path) {
+    char line[256];
+    int nb_lines;
+    FILE *fp;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    nb_lines = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        struct mixoss_control *ctrl;
+        struct ceiling *ceiling;
+        char *name, *max;
+
+        nb_lines++;
+        if (line[0] == '#')
+            continue;
+
+        /* control max */
+        name = strtok(line, " \t\n");
+        if (!name)
+            continue;
+        max = strtok(NULL, " \t\n");
+
+        if (!max || atoi(max) < 0 || atoi(max) > 100) {
+            fprintf(stderr, "%s:%d: invalid ceiling\n", path, nb_lines);
+            goto error;
+        }
+
+        ctrl = mixoss_lookup(mx, name);
+        if (!ctrl || !is_slider(ctrl)) {
+            fprintf(stderr, "%s:%d: unknown slider '%s'\n",
+                    path, nb_lines, name);
+            goto error;
+        }
+
+        ceiling = realloc(ceilings, (nb_ceilings + 1) * sizeof(*ceiling));
+        if (!ceiling) {
+            perror("cannot allocate ceilings");
+            goto error;
+        }
+        ceilings = ceiling;
+
+        ceiling = &ceilings[nb_ceilings++];
+        mixoss_format_name(ctrl, ceiling->name, sizeof(ceiling->name));
+        ceiling->dev = ctrl->info.dev;
+        ceiling->max = atoi(max);
+        ceiling->counter = -1;
+    }
+
+    fclose(fp);
+    return 0;
+
+error:
+    fclose(fp);
+    free(ceilings);
+    ceilings = NULL;
+    nb_ceilings = 0;
+    return -1;
+}
+
+static void
+check_ceilings(unsigned long long now) {
+    next_ceiling_check = now + ceiling_interval * 1000ULL;
+
+    /* Only the mixers holding a ceiling are looked at, and their watched
+     * controls are only read once modify_counter moved: the regular poll
+     * takes care of everything else at its own rate. */
+    for (int m = 0; m < mx->nb_mixers; m++) {
+        struct oss_mixerinfo info;
+        int first;
+
+        first = -1;
+        for (int i = 0; i < nb_ceilings && first < 0; i++) {
+            if (ceilings[i].dev == m)
+                first = i;
+        }
+        if (first < 0)
+            continue;
+
+        info.dev = m;
+        if (mixoss_ioctl(mx, MIXOSS_OP_MIXERINFO, NULL,
+                         SNDCTL_MIXERINFO, &info) < 0
+         || info.modify_counter == ceilings[first].counter) {
+            continue;
+        }
+
+        for (int i = first; i < nb_ceilings; i++) {
+            struct ceiling *ceiling = &ceilings[i];
+            struct mixoss_control *ctrl;
+            struct ramp *ramp;
+            int left, right;
+
+            if (ceiling->dev != m)
+                continue;
+            ceiling->counter = info.modify_counter;
+
+            ctrl = mixoss_lookup(mx, ceiling->name);
+            if (!ctrl || mixoss_read(mx, ctrl) == -1)
+                continue;
+
+            /* A fade in flight would push the level up again */
+            ramp = find_ramp(ctrl);
+            if (ramp) {
+                if (ramp->to_left > ceiling->max)
+                    ramp->to_left = ceiling->max;
+                if (ramp->to_right > ceiling->max)
+                    ramp->to_right = ceiling->max;
+            }
+
+            mixoss_decode_value(ctrl, ctrl->value, &left, &right);
+            if (left <= ceiling->max && right <= ceiling->max)
+                continue;
+
+            left = left > ceiling->max ? ceiling->max : left;
+            right = right > ceiling->max ? ceiling->max : right;
+            mixoss_queue_write(mx, ctrl,
+                               mixoss_encode_value(ctrl, left, right));
+        }
+    }
+
+    mixoss_flush(mx);
+}
+
+static int
+load_hooks(const char *path) {
+    char line[1024];
+    int nb_lines;
+    FILE *fp;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    nb_lines = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        char pattern[CONTROL_NAME_SIZE];
+        char *name, *command, *end;
+        struct hook *hook;
+        size_t len;
+
+        nb_lines++;
+        line[strcspn(line, "\n")] = '\0';
+
+        /* <control>|<mixer>:* <command> */
+        name = line + strspn(line, " \t");
+        if (*name == '\0' || *name == '#')
+            continue;
+        end = name + strcspn(name, " \t");
+        command = end + strspn(end, " \t");
+        *end = '\0';
+
+        if (*command == '\0') {
+            fprintf(stderr, "%s:%d: missing command\n", path, nb_lines);
+            goto error;
+        }
+
+        len = strlen(name);
+        if (len >= 2 && strcmp(name + len - 2, ":*") == 0) {
+            struct mixoss_mixer *mixer;
+
+            mixer = mixoss_find_mixer(mx, name, len - 2);
+            if (!mixer) {
+                fprintf(stderr, "%s:%d: unknown mixer\n", path, nb_lines);
+                goto error;
+            }
+            snprintf(pattern, sizeof(pattern), "%d:*",
+                     (int)(mixer - mx->mixers));
+        } else {
+            struct mixoss_control *ctrl;
+
+            ctrl = mixoss_lookup(mx, name);
+            if (!ctrl) {
+                fprintf(stderr, "%s:%d: unknown control '%s'\n",
+                        path, nb_lines, name);
+                goto error;
+            }
+            mixoss_format_name(ctrl, pattern, sizeof(pattern));
+        }
+
+        hook = realloc(hooks, (nb_hooks + 1) * sizeof(struct hook));
+        if (!hook) {
+            perror("cannot allocate hooks");
+            goto error;
+        }
+        hooks = hook;
+
+        hook = &hooks[nb_hooks];
+        memset(hook, 0, sizeof(*hook));
+        strcpy(hook->pattern, pattern);
+        hook->command = malloc(strlen(command) + 1);
+        if (!hook->command) {
+            perror("cannot allocate hooks");
+            goto error;
+        }
+        strcpy(hook->command, command);
+        nb_hooks++;
+    }
+
+    fclose(fp);
+    return 0;
+
+error:
+    fclose(fp);
+    free_hooks();
+    return -1;
+}
+
+static void
+free_hooks() {
+    for (int i = 0; i < nb_hooks; i++)
+        free(hooks[i].command);
+
+    free(hooks);
+    hooks = NULL;
+    nb_hooks = 0;
+}
+
+static void
+queue_hooks(const struct mixoss_control *ctrl, unsigned long long now) {
+    char name[CONTROL_NAME_SIZE];
+
+    mixoss_format_name(ctrl, name, sizeof(name));
+
+    for (int i = 0; i < nb_hooks; i++) {
+        struct hook *hook = &hooks[i];
+        size_t len;
+
+        len = strlen(hook->pattern);
+        if (strcmp(hook->pattern, name) != 0
+         && (hook->pattern[len - 1] != '*'
+          || strncmp(hook->pattern, name, len - 1) != 0)) {
+            continue;
+        }
+
+        /* Changes within the window are coalesced, the command only gets
+         * the latest one */
+        if (!hook->pending) {
+            hook->pending = 1;
+            hook->fire_at = now + hook_window * 1000ULL;
+        }
+        strcpy(hook->name, name);
+        mixoss_format_value(ctrl, hook->value, sizeof(hook->value));
+    }
+}
+
+static void
+start_hook(struct hook *hook) {
+    char control_var[CONTROL_NAME_SIZE + 16];
+    char value_var[sizeof(hook->value) + 16];
+    char **env;
+    int nb_env;
+    pid_t pid;
+
+    /* The environment is built before forking: only async-signal-safe
+     * functions may be called in the child of a threaded process */
+    nb_env = 0;
+    while (environ[nb_env])
+        nb_env++;
+
+    env = malloc((nb_env + 3) * sizeof(char *));
+    if (!env) {
+        set_ui_error("cannot run hook: %s", strerror(errno));
+        hook->pending = 0;
+        return;
+    }
+
+    snprintf(control_var, sizeof(control_var), "MIXOSS_CONTROL=%s",
+             hook->name);
+    snprintf(value_var, sizeof(value_var), "MIXOSS_VALUE=%s", hook->value);
+
+    nb_env = 0;
+    for (char **var = environ; *var; var++) {
+        if (strncmp(*var, "MIXOSS_CONTROL=", 15) != 0
+         && strncmp(*var, "MIXOSS_VALUE=", 13) != 0) {
+            env[nb_env++] = *var;
+        }
+    }
+    env[nb_env++] = control_var;
+    env[nb_env++] = value_var;
+    env[nb_env] = NULL;
+
+    pid = fork();
+    if (pid == -1) {
+        set_ui_error("cannot run hook: %s", strerror(errno));
+        free(env);
+        hook->pending = 0;
+        return;
+    }
+
+    if (pid == 0) {
+        sigset_t set;
+        int fd;
+
+        /* Ignored signals and the mask survive exec, a command gets the
+         * defaults: the daemon ignores SIGPIPE for its own sockets */
+        signal(SIGPIPE, SIG_DFL);
+        sigemptyset(&set);
+        sigprocmask(SIG_SETMASK, &set, NULL);
+
+        /* Hooks must not draw over the interface */
+        fd = open("/dev/null", O_RDWR);
+        if (fd >= 0) {
+            dup2(fd, STDIN_FILENO);
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            if (fd > STDERR_FILENO)
+                close(fd);
+        }
+
+        execle("/bin/sh", "sh", "-c", hook->command, (char *)NULL, env);
+        _exit(127);
+    }
+
+    free(env);
+    hook->pid = pid;
+    hook->pending = 0;
+    nb_hook_jobs++;
+}
+
+static void
+run_hooks(unsigned long long now) {
+    pid_t pid;
+
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        for (int i = 0; i < nb_hooks; i++) {
+            if (hooks[i].pid == pid) {
+                hooks[i].pid = 0;
+                nb_hook_jobs--;
+            }
+        }
+    }
+
+    /* A hook still running keeps its next changes pending, and no more
+     * than max_hook_jobs commands run at once */
+    for (int i = 0; i < nb_hooks && nb_hook_jobs < max_hook_jobs; i++) {
+        struct hook *hook = &hooks[i];
+
+        if (hook->pending && !hook->pid && now >= hook->fire_at)
+            start_hook(hook);
+    }
+}
+
+/* Earliest of deadline and the end of the window of a hook which can be
+ * started; running ones are waited for by the regular poll */
+static unsigned long long
+next_hook_deadline(unsigned long long deadline) {
+    if (nb_hook_jobs >= max_hook_jobs)
+        return deadline;
+
+    for (int i = 0; i < nb_hooks; i++) {
+        struct hook *hook = &hooks[i];
+
+        if (hook->pending && !hook->pid && hook->fire_at < deadline)
+            deadline = hook->fire_at;
+    }
+
+    return deadline;
+}
+
+static int
+open_journal() {
+    int ret;
+
+    journal.fd = open(journal_path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (journal.fd == -1) {
+        fprintf(stderr, "cannot open %s: %s\n", journal_path,
+                strerror(errno));
+        return -1;
+    }
+    mixoss_set_cloexec(journal.fd);
+
+    journal.buf = malloc(JOURNAL_BUFFER_SIZE);
+    if (!journal.buf) {
+        perror("cannot allocate journal");
+        close(journal.fd);
+        return -1;
+    }
+
+    pthread_mutex_init(&journal.lock, NULL);
+    pthread_cond_init(&journal.cond, NULL);
+
+    ret = pthread_create(&journal.thread, NULL, run_journal, NULL);
+    if (ret != 0) {
+        fprintf(stderr, "cannot start journal: %s\n", strerror(ret));
+        free(journal.buf);
+        close(journal.fd);
+        return -1;
+    }
+
+    /* Every change is recorded as it happens, so that a write of ours
+     * and an outside change within the same tick are told apart */
+    mixoss_set_change_handler(mx, journal_change, NULL);
+
+    return 0;
+}
+
+static void
+close_journal() {
+    if (!journal.buf)
+        return;
+
+    mixoss_set_change_handler(mx, NULL, NULL);
+
+    /* The writer flushes whatever is left before exiting */
+    pthread_mutex_lock(&journal.lock);
+    journal.stop = 1;
+    pthread_cond_signal(&journal.cond);
+    pthread_mutex_unlock(&journal.lock);
+
+    pthread_join(journal.thread, NULL);
+    pthread_mutex_destroy(&journal.lock);
+    pthread_cond_destroy(&journal.cond);
+
+    close(journal.fd);
+    free(journal.buf);
+    journal.buf = NULL;
+}
+
+static void *
+run_journal(void *arg) {
+    unsigned long long last_sync;
+    char *out;
+    int stop;
+
+    out = malloc(JOURNAL_BUFFER_SIZE);
+    if (!out)
+        return NULL;
+
+    last_sync = mixoss_time_us();
+
+    do {
+        struct timespec deadline;
+        unsigned long nb_dropped, nb_lost;
+        unsigned long long now;
+        size_t len, done;
+        char *tmp;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += journal_flush_interval / 1000;
+        deadline.tv_nsec += (journal_flush_interval % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        /* Records pile up for a whole interval, then both buffers are
+         * swapped so that the loops can go on while this one is written */
+        pthread_mutex_lock(&journal.lock);
+        while (!journal.stop) {
+            if (pthread_cond_timedwait(&journal.cond, &journal.lock,
+                                       &deadline) != 0) {
+                break;
+            }
+        }
+        stop = journal.stop;
+        tmp = journal.buf;
+        journal.buf = out;
+        out = tmp;
+        len = journal.len;
+        journal.len = 0;
+        nb_dropped = journal.nb_dropped;
+        journal.nb_dropped = 0;
+        pthread_mutex_unlock(&journal.lock);
+
+        nb_lost = 0;
+        if (nb_dropped > 0) {
+            char line[64];
+            size_t line_len;
+
+            line_len = snprintf(line, sizeof(line),
+                                "# %lu records dropped\n", nb_dropped);
+            if (write_journal(line, line_len) < line_len)
+                nb_lost += nb_dropped;
+        }
+
+        /* Records which could not be written are counted as dropped, and
+         * reported with the next batch */
+        done = write_journal(out, len);
+        for (size_t i = done; i < len; i++) {
+            if (out[i] == '\n')
+                nb_lost++;
+        }
+
+        if (nb_lost > 0) {
+            pthread_mutex_lock(&journal.lock);
+            journal.nb_dropped += nb_lost;
+            pthread_mutex_unlock(&journal.lock);
+        }
+
+        /* fsync() is what costs, it is spread over several flushes */
+        now = mixoss_time_us();
+        if (len > 0 && (stop || now - last_sync
+                                >= journal_sync_interval * 1000ULL)) {
+            fsync(journal.fd);
+            last_sync = now;
+        }
+    } while (!stop);
+
+    free(out);
+    return NULL;
+}
+
+static void
+format_journal_value(const struct mixoss_control *ctrl, int value,
+                     char *buf, size_t size) {
+    int left, right;
+
+    if (mixoss_decode_value(ctrl, value, &left, &right) == 2) {
+        snprintf(buf, size, "%d,%d", left, right);
+    } else {
+        snprintf(buf, size, "%d", left);
+    }
+}
+
+static size_t
+write_journal(const char *buf, size_t len) {
+    size_t done;
+
+    for (done = 0; done < len;) {
+        ssize_t n;
+
+        n = write(journal.fd, buf + done, len - done);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        done += n;
+    }
+
+    return done;
+}
+
+static void
+journal_change(void *data, const struct mixoss_control *ctrl, int old,
+               int written) {
+    char old_value[32], new_value[32];
+    char name[CONTROL_NAME_SIZE];
+    struct timespec ts;
+    char line[128];
+    int len;
+
+    /* Called by the library with the context locked, this only formats
+     * the record and appends it to the buffer */
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    format_journal_value(ctrl, old, old_value, sizeof(old_value));
+    format_journal_value(ctrl, ctrl->value, new_value, sizeof(new_value));
+    mixoss_format_name(ctrl, name, sizeof(name));
+
+    /* <time> <control> <old> <new> own|outside, the control named as
+     * everywhere else so that an ambiguous id is not logged as such */
+    len = snprintf(line, sizeof(line), "%lld.%06ld %s %s %s %s\n",
+                   (long long)ts.tv_sec, ts.tv_nsec / 1000,
+                   name, old_value, new_value, written ? "own" : "outside");
+    if (len < 0 || len >= (int)sizeof(line))
+        return;
+
+    pthread_mutex_lock(&journal.lock);
+    if (journal.len + len > JOURNAL_BUFFER_SIZE) {
+        journal.nb_dropped++;
+    } else {
+        memcpy(journal.buf + journal.len, line, len);
+        journal.len += len;
+    }
+    pthread_mutex_unlock(&journal.lock);
+}
+
+static void
+dispatch_changes() {
+    unsigned long long now;
+    int reloaded, changed;
+
+    /* Every frontend reports value changes through here once per loop,
+     * whoever made them. Mirrors go first so that their writes are part
+     * of the same round. */
+    if (nb_mirrors > 0 && run_mirrors() > 0 && ui_active)
+        draw_ui();
+
+    now = mixoss_time_us();
+
+    /* Values read after a (re)load are not changes worth a hook */
+    reloaded = mx->reloaded;
+    changed = mx->reloaded;
+    mx->reloaded = 0;
+
+    for (int m = 0; m < mx->nb_mixers; m++) {
+        struct mixoss_mixer *mixer = &mx->mixers[m];
+
+        for (int c = 0; c < mixer->nb_controls; c++) {
+            struct mixoss_control *ctrl = &mixer->controls[c];
+
+            if (!ctrl->changed)
+                continue;
+            ctrl->changed = 0;
+            changed = 1;
+
+            if (clients)
+                notify_clients(ctrl);
+
+            if (nb_hooks > 0 && !reloaded)
+                queue_hooks(ctrl, now);
+        }
+    }
+
+    if (nb_hooks > 0)
+        run_hooks(now);
+
+    if (changed && shm)
+        publish_state();
+
+    if (export_path)
+        export_metrics(changed);
+}
+
+static int
+run_peek(const char **names, int nb_names) {
+    static char path[1024];
+    struct mixoss_shm_reader reader;
+    int status;
+
+    if (!shm_path) {
+        mixoss_runtime_path(path, sizeof(path), "shm");
+        shm_path = path;
+    }
+
+    if (mixoss_shm_open(&reader, shm_path) == -1) {
+        fprintf(stderr, "cannot map %s: %s\n", shm_path, strerror(errno));
+        return 1;
+    }
+
+    status = 0;
+    for (int i = 0; i < nb_names; i++) {
+        struct mixoss_shm_control sctrl;
+
+        if (mixoss_shm_read(&reader, names[i], &sctrl) == -1) {
+            if (errno == ENOENT) {
+                fprintf(stderr, "unknown control '%s'\n", names[i]);
+            } else if (errno == EEXIST) {
+                fprintf(stderr, "ambiguous control '%s', name it by"
+                        " #index\n", names[i]);
+            } else {
+                fprintf(stderr, "cannot read %s: %s\n", names[i],
+                        strerror(errno));
+            }
+            status = 1;
+        } else if (sctrl.nb_channels == 2) {
+            printf("%s=%d,%d\n", names[i], sctrl.left, sctrl.right);
+        } else {
+            printf("%s=%d\n", names[i], sctrl.left);
+        }
+    }
+
+    mixoss_shm_close(&reader);
+    return status;
+}
+
+static void
+print_prom_string(FILE *fp, const char *str) {
+    fputc('"', fp);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            fprintf(fp, "\\%c", *str);
+        } else if (*str == '\n') {
+            fputs("\\n", fp);
+        } else {
+            fputc(*str, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+static void
+write_control_metrics(FILE *fp) {
+    static const char *channels[] = {"left", "right"};
+
+    fputs("# HELP mixoss_control_value Control value, in percent for"
+          " sliders.\n", fp);
+    fputs("# TYPE mixoss_control_value gauge\n", fp);
+
+    for (int m = 0; m < mx->nb_mixers; m++) {
+        struct mixoss_mixer *mixer = &mx->mixers[m];
+
+        for (int c = 0; c < mixer->nb_controls; c++) {
+            struct mixoss_control *ctrl = &mixer->controls[c];
+            int values[2];
+            int nb_channels;
+
+            if (!mixoss_is_value_control(ctrl))
+                continue;
+
+            nb_channels = mixoss_decode_value(ctrl, ctrl->value,
+                                              &values[0], &values[1]);
+            for (int i = 0; i < nb_channels; i++) {
+                fputs("mixoss_control_value{mixer=", fp);
+                print_prom_string(fp, mixer->info.id);
+                fputs(",control=", fp);
+                print_prom_string(fp, ctrl->info.id);
+
+                /* Ids are not unique within a mixer, the index is */
+                fprintf(fp, ",ctrl=\"%d\",channel=\"%s\"} %d\n",
+                        ctrl->info.ctrl,
+                        nb_channels == 2 ? channels[i] : "mono", values[i]);
+            }
+        }
+    }
+}
+
+static void
+write_mixer_metrics(FILE *fp) {
+    fputs("# HELP mixoss_mixer_enabled Whether the mixer is enabled.\n", fp);
+    fputs("# TYPE mixoss_mixer_enabled gauge\n", fp);
+    for (int m = 0; m < mx->nb_mixers; m++) {
+        fputs("mixoss_mixer_enabled{mixer=", fp);
+        print_prom_string(fp, mx->mixers[m].info.id);
+        fputs(",name=", fp);
+        print_prom_string(fp, mx->mixers[m].info.name);
+        fprintf(fp, "} %d\n", mx->mixers[m].info.enabled ? 1 : 0);
+    }
+
+    fputs("# HELP mixoss_mixer_health Health of the mixer as seen by"
+          " mixoss.\n", fp);
+    fputs("# TYPE mixoss_mixer_health gauge\n", fp);
+    for (int m = 0; m < mx->nb_mixers; m++) {
+        for (int h = MIXOSS_OK; h <= MIXOSS_GONE; h++) {
+            fputs("mixoss_mixer_health{mixer=", fp);
+            print_prom_string(fp, mx->mixers[m].info.id);
+            fprintf(fp, ",state=\"%s\"} %d\n", mixoss_health_names[h],
+                    mx->mixers[m].health == (enum mixoss_health)h);
+        }
+    }
+
+    fputs("# HELP mixoss_ioctl_requests_total Mixer ioctls issued.\n", fp);
+    fputs("# TYPE mixoss_ioctl_requests_total counter\n", fp);
+    for (int op = 0; op < MIXOSS_NB_OPS; op++) {
+        fprintf(fp, "mixoss_ioctl_requests_total{op=\"%s\"} %lu\n",
+                mixoss_op_names[op], mx->op_stats[op].count);
+    }
+
+    fputs("# HELP mixoss_ioctl_errors_total Mixer ioctls which failed.\n",
+          fp);
+    fputs("# TYPE mixoss_ioctl_errors_total counter\n", fp);
+    for (int op = 0; op < MIXOSS_NB_OPS; op++) {
+        fprintf(fp, "mixoss_ioctl_errors_total{op=\"%s\"} %lu\n",
+                mixoss_op_names[op], mx->op_stats[op].errors);
+    }
+}
+
+static void
+export_metrics(int changed) {
+    char tmp_path[1100];
+    unsigned long errors;
+    FILE *fp;
+
+    /* Request counters move at every poll, they are only brought up to
+     * date along with the rest so that an idle mixer costs no write. */
+    errors = 0;
+    for (int op = 0; op < MIXOSS_NB_OPS; op++)
+        errors += mx->op_stats[op].errors;
+    if (errors != export_errors || !export_written)
+        changed = 1;
+
+    if (nb_exported_health != mx->nb_mixers) {
+        enum mixoss_health *health;
+
+        health = realloc(exported_health,
+                         mx->nb_mixers * sizeof(enum mixoss_health));
+        if (!health) {
+            set_ui_error("cannot allocate mixer health: %s",
+                         strerror(errno));
+            return;
+        }
+        for (int m = nb_exported_health; m < mx->nb_mixers; m++)
+            health[m] = mx->mixers[m].health;
+
+        exported_health = health;
+        nb_exported_health = mx->nb_mixers;
+        changed = 1;
+    }
+
+    for (int m = 0; m < mx->nb_mixers; m++) {
+        if (exported_health[m] != mx->mixers[m].health) {
+            exported_health[m] = mx->mixers[m].health;
+            changed = 1;
+        }
+    }
+
+    if (!changed)
+        return;
+
+    fp = create_temp_file(export_path, tmp_path, sizeof(tmp_path));
+    if (!fp) {
+        set_ui_error("cannot create %s: %s", tmp_path, strerror(errno));
+        return;
+    }
+
+    write_control_metrics(fp);
+    write_mixer_metrics(fp);
+
+    if (commit_temp_file(fp, tmp_path, export_path) == -1) {
+        set_ui_error("cannot write %s: %s", export_path, strerror(errno));
+        return;
+    }
+
+    export_errors = errors;
+    export_written = 1;
+}
+
+static int
+run_export() {
+    unsigned long long next_poll;
+
+    catch_quit_signals();
+
+    for (int m = 0; m < mx->nb_mixers; m++)
+        mixoss_poll(mx, &mx->mixers[m]);
+    dispatch_changes();
+
+    next_poll = mixoss_time_us() + poll_interval * 1000ULL;
+
+    while (!quit_requested) {
+        unsigned long long now;
+        struct timespec ts;
+
+        now = mixoss_time_us();
+        if (next_poll > now) {
+            ts.tv_sec = (next_poll - now) / 1000000;
+            ts.tv_nsec = (next_poll - now) % 1000000 * 1000;
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        next_poll = now + poll_interval * 1000ULL;
+
+        mixoss_refresh(mx);
+        for (int m = 0; m < mx->nb_mixers; m++)
+            mixoss_poll(mx, &mx->mixers[m]);
+        dispatch_changes();
+    }
+
+    return 0;
+}
+
+static void
+request_quit(int sig) {
+    quit_requested = 1;
+}
+
+static void
+catch_quit_signals() {
+    struct sigaction sa;
+
+    /* Without SA_RESTART, so that select() returns at once */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_quit;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+static int
+open_server_socket() {
+    struct sockaddr_un addr;
+    mode_t mask;
+    int fd;
+    int ret;
+
+    if (get_socket_addr(&addr) == -1
+     || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        fprintf(stderr, "cannot create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    mixoss_set_cloexec(fd);
+
+    /* Only the user may talk to the daemon */
+    mask = umask(077);
+    ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    if (ret == -1 && errno == EADDRINUSE) {
+        int probe;
+
+        /* A socket nobody listens on was left over by a daemon which did
+         * not exit cleanly */
+        probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (probe != -1
+         && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == -1
+         && errno == ECONNREFUSED) {
+            unlink(socket_path);
+            ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+        } else {
+            errno = EADDRINUSE;
+        }
+        if (probe != -1)
+            close(probe);
+    }
+    umask(mask);
+
+    if (ret == -1 || listen(fd, 8) == -1
+     || fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+        fprintf(stderr, "cannot listen on %s: %s\n",
+                socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void
+accept_client(int listen_fd) {
+    struct client *client;
+    int fd;
+
+    fd = accept(listen_fd, NULL, NULL);
+    if (fd == -1)
+        return;
+    mixoss_set_cloexec(fd);
+
+    /* select() cannot watch it */
+    if (fd >= FD_SETSIZE) {
+        set_ui_error("too many clients, connection refused");
+        close(fd);
+        return;
+    }
+
+    client = calloc(1, sizeof(struct client));
+    if (!client || fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+        set_ui_error("cannot accept client: %s", strerror(errno));
+        free(client);
+        close(fd);
+        return;
+    }
+
+    client->fd = fd;
+    client->next = clients;
+    clients = client;
+}
+
+static void
+free_client(struct client *client) {
+    close(client->fd);
+    free(client->out);
+    free(client->filters);
+    free(client);
+}
+
+static void
+send_to_client(struct client *client, const char *fmt, ...) {
+    char line[MIXOSS_LINE_SIZE];
+    va_list ap;
+    int len;
+
+    if (client->closed)
+        return;
+
+    va_start(ap, fmt);
+    len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (len >= (int)sizeof(line))
+        len = sizeof(line) - 1;
+
+    if (client->out_len + len > client->out_size) {
+        size_t size;
+        char *out;
+
+        /* A subscriber which does not read its notifications would
+         * otherwise make the daemon grow without limit */
+        size = client->out_size ? 2 * client->out_size : 4096;
+        while (size < client->out_len + len)
+            size *= 2;
+        if (size > CLIENT_MAX_OUTPUT) {
+            client->closed = 1;
+            return;
+        }
+
+        out = realloc(client->out, size);
+        if (!out) {
+            client->closed = 1;
+            return;
+        }
+        client->out = out;
+        client->out_size = size;
+    }
+
+    memcpy(client->out + client->out_len, line, len);
+    client->out_len += len;
+}
+
+static void
+flush_client(struct client *client) {
+    ssize_t n;
+
+    if (client->closed || client->out_len == 0)
+        return;
+
+    n = write(client->fd, client->out, client->out_len);
+    if (n == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            client->closed = 1;
+        return;
+    }
+
+    client->out_len -= n;
+    memmove(client->out, client->out + n, client->out_len);
+}
+
+static void
+serve_ioctl(struct client *client, char *args) {
+    union {
+        int nb;
+        struct oss_mixerinfo mixer;
+        struct oss_mixext ext;
+        struct oss_mixer_value val;
+        struct oss_audioinfo audio;
+    } arg;
+    char hex[MIXOSS_HEX_ARG_SIZE];
+    struct mixoss_control *ctrl;
+    enum mixoss_op op;
+    char *sep;
+    int ret;
+
+    sep = strchr(args, ' ');
+    if (!sep) {
+        send_to_client(client, "error invalid ioctl\n");
+        return;
+    }
+    *sep = '\0';
+
+    for (op = 0; op < MIXOSS_NB_OPS; op++) {
+        if (strcmp(mixoss_op_names[op], args) == 0)
+            break;
+    }
+    if (op == MIXOSS_NB_OPS) {
+        send_to_client(client, "error unknown ioctl '%s'\n", args);
+        return;
+    }
+
+    memset(&arg, 0, sizeof(arg));
+    mixoss_decode_hex(sep + 1, &arg, mixoss_op_arg_sizes[op]);
+
+    /* Everything the daemon keeps up to date is answered from its cache,
+     * only the rest reaches the device. */
+    ret = 0;
+    switch (op) {
+        case MIXOSS_OP_NRMIX:
+            arg.nb = mx->nb_mixers;
+            break;
+
+        case MIXOSS_OP_MIXERINFO:
+            if (arg.mixer.dev < 0 || arg.mixer.dev >= mx->nb_mixers) {
+                errno = ENXIO;
+                ret = -1;
+            } else {
+                arg.mixer = mx->mixers[arg.mixer.dev].info;
+            }
+            break;
+
+        case MIXOSS_OP_EXTINFO:
+            ctrl = mixoss_get_control(mx, arg.ext.dev, arg.ext.ctrl);
+            if (ctrl) {
+                arg.ext = ctrl->info;
+            } else {
+                ret = mixoss_ioctl(mx, op, NULL, SNDCTL_MIX_EXTINFO, &arg);
+            }
+            break;
+
+        case MIXOSS_OP_READ:
+        case MIXOSS_OP_WRITE:
+            ctrl = mixoss_get_control(mx, arg.val.dev, arg.val.ctrl);
+            if (!ctrl) {
+                ret = mixoss_ioctl(mx, op, NULL, op == MIXOSS_OP_READ
+                                                 ? SNDCTL_MIX_READ
+                                                 : SNDCTL_MIX_WRITE, &arg);
+            } else if (ctrl->info.timestamp != arg.val.timestamp) {
+                errno = EIDRM;
+                ret = -1;
+            } else if (op == MIXOSS_OP_READ) {
+                arg.val.value = ctrl->value;
+            } else {
+                ret = mixoss_write(mx, ctrl, arg.val.value);
+            }
+            break;
+
+        case MIXOSS_OP_ENGINEINFO:
+            ret = mixoss_ioctl(mx, op, NULL, SNDCTL_ENGINEINFO, &arg);
+            break;
+
+        default:
+            break;
+    }
+
+    if (ret == -1) {
+        send_to_client(client, "ioctl -1 %d -\n", errno);
+        return;
+    }
+
+    mixoss_encode_hex(hex, &arg, mixoss_op_arg_sizes[op]);
+    send_to_client(client, "ioctl %d 0 %s\n", ret, hex);
+}
+
+static void
+handle_request(struct client *client, char *line) {
+    char name[CONTROL_NAME_SIZE];
+    char value[32];
+    struct mixoss_control *ctrl;
+    char *args;
+
+    args = strchr(line, ' ');
+    if (args) {
+        *args++ = '\0';
+    } else {
+        args = line + strlen(line);
+    }
+
+    if (strcmp(line, "ioctl") == 0) {
+        serve_ioctl(client, args);
+    } else if (strcmp(line, "list") == 0) {
+        for (int m = 0; m < mx->nb_mixers; m++) {
+            struct mixoss_mixer *mixer = &mx->mixers[m];
+
+            send_to_client(client, "mixer %d %s %s %s\n", m,
+                           mixoss_health_names[mixer->health],
+                           mixer->info.id, mixer->info.name);
+
+            for (int c = 0; c < mixer->nb_controls; c++) {
+                ctrl = &mixer->controls[c];
+                if (!mixoss_is_value_control(ctrl))
+                    continue;
+
+                mixoss_format_name(ctrl, name, sizeof(name));
+                mixoss_format_value(ctrl, value, sizeof(value));
+                send_to_client(client, "control %s %s%s %s %s\n", name,
+                               ctrl->info.flags & MIXF_READABLE ? "r" : "",
+                               ctrl->info.flags & MIXF_WRITEABLE ? "w" : "",
+                               value, ctrl->info.extname);
+            }
+        }
+        send_to_client(client, "end\n");
+    } else if (strcmp(line, "get") == 0) {
+        ctrl = mixoss_lookup(mx, args);
+        if (!ctrl || !mixoss_is_value_control(ctrl)) {
+            send_to_client(client, "error unknown control '%s'\n", args);
+            return;
+        }
+
+        mixoss_format_name(ctrl, name, sizeof(name));
+        mixoss_format_value(ctrl, value, sizeof(value));
+        send_to_client(client, "value %s %s\n", name, value);
+    } else if (strcmp(line, "set") == 0) {
+        char *values;
+        int left, right;
+
+        values = strchr(args, ' ');
+        if (values)
+            *values++ = '\0';
+
+        ctrl = mixoss_lookup(mx, args);
+        if (!ctrl || !mixoss_is_value_control(ctrl)) {
+            send_to_client(client, "error unknown control '%s'\n", args);
+            return;
+        }
+
+        if (!(ctrl->info.flags & MIXF_WRITEABLE)) {
+            send_to_client(client, "error control '%s' is read-only\n", args);
+            return;
+        }
+
+        if (!values || mixoss_parse_value(ctrl, values,
+                                          &left, &right) == -1) {
+            send_to_client(client, "error invalid value\n");
+            return;
+        }
+
+        fade_control(ctrl, left, right, fade_duration);
+        mixoss_flush(mx);
+
+        if (ctrl->write_error) {
+            send_to_client(client, "error %s\n", strerror(ctrl->write_error));
+            ctrl->write_error = 0;
+            return;
+        }
+        send_to_client(client, "ok\n");
+    } else if (strcmp(line, "subscribe") == 0) {
+        char (*filters)[CONTROL_NAME_SIZE];
+        int nb_filters;
+        char *tok;
+
+        filters = NULL;
+        nb_filters = 0;
+        for (tok = strtok(args, " "); tok; tok = strtok(NULL, " ")) {
+            void *nfilters;
+
+            ctrl = mixoss_lookup(mx, tok);
+            if (!ctrl || !mixoss_is_value_control(ctrl)) {
+                send_to_client(client, "error unknown control '%s'\n", tok);
+                free(filters);
+                return;
+            }
+
+            nfilters = realloc(filters, (nb_filters + 1) * sizeof(*filters));
+            if (!nfilters) {
+                send_to_client(client, "error %s\n", strerror(errno));
+                free(filters);
+                return;
+            }
+            filters = nfilters;
+
+            /* Names are kept rather than pointers, which do not survive
+             * a reload of the mixer */
+            mixoss_format_name(ctrl, filters[nb_filters], sizeof(*filters));
+            nb_filters++;
+        }
+
+        free(client->filters);
+        client->filters = filters;
+        client->nb_filters = nb_filters;
+        client->subscribed = 1;
+        send_to_client(client, "ok\n");
+    } else if (strcmp(line, "unsubscribe") == 0) {
+        free(client->filters);
+        client->filters = NULL;
+        client->nb_filters = 0;
+        client->subscribed = 0;
+        send_to_client(client, "ok\n");
+    } else {
+        send_to_client(client, "error unknown command '%s'\n", line);
+    }
+}
+
+static void
+read_client(struct client *client) {
+    char *line, *nl;
+    ssize_t n;
+
+    n = read(client->fd, client->in + client->in_len,
+             sizeof(client->in) - client->in_len);
+    if (n == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            client->closed = 1;
+        return;
+    }
+    if (n == 0) {
+        client->closed = 1;
+        return;
+    }
+    client->in_len += n;
+
+    line = client->in;
+    while ((nl = memchr(line, '\n', client->in_len - (line - client->in)))) {
+        *nl = '\0';
+        if (nl > line && nl[-1] == '\r')
+            nl[-1] = '\0';
+        handle_request(client, line);
+        line = nl + 1;
+    }
+
+    client->in_len -= line - client->in;
+    memmove(client->in, line, client->in_len);
+
+    if (client->in_len == sizeof(client->in)) {
+        send_to_client(client, "error line too long\n");
+        flush_client(client);
+        client->closed = 1;
+    }
+}
+
+static void
+notify_clients(const struct mixoss_control *ctrl) {
+    char name[CONTROL_NAME_SIZE];
+    char value[32];
+
+    mixoss_format_name(ctrl, name, sizeof(name));
+    mixoss_format_value(ctrl, value, sizeof(value));
+
+    for (struct client *client = clients; client; client = client->next) {
+        int match;
+
+        if (!client->subscribed)
+            continue;
+
+        match = client->nb_filters == 0;
+        for (int f = 0; f < client->nb_filters && !match; f++)
+            match = strcmp(client->filters[f], name) == 0;
+
+        if (match)
+            send_to_client(client, "change %s %s\n", name, value);
+    }
+}
+
+static int
+run_daemon() {
+    unsigned long long next_poll;
+    int listen_fd;
+
+    listen_fd = open_server_socket();
+    if (listen_fd == -1)
+        return 1;
+
+    catch_quit_signals();
+    signal(SIGPIPE, SIG_IGN);
+
+    /* The daemon keeps every mixer up to date, the initial state is not
+     * a change. */
+    for (int m = 0; m < mx->nb_mixers; m++)
+        mixoss_poll(mx, &mx->mixers[m]);
+    dispatch_changes();
+
+    next_poll = mixoss_time_us() + poll_interval * 1000ULL;
+
+    while (!quit_requested) {
+        unsigned long long now, deadline;
+        fd_set readfds, writefds;
+        struct timeval stimeout;
+        struct client **pclient;
+        int max_fd;
+
+        FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+        FD_SET(listen_fd, &readfds);
+        max_fd = listen_fd;
+        for (struct client *client = clients; client; client = client->next) {
+            FD_SET(client->fd, &readfds);
+            if (client->out_len > 0)
+                FD_SET(client->fd, &writefds);
+            if (client->fd > max_fd)
+                max_fd = client->fd;
+        }
+
+        deadline = next_poll;
+        if (ramps && next_ramp_tick < deadline)
+            deadline = next_ramp_tick;
+        if (nb_ducks > 0 && next_duck_check < deadline)
+            deadline = next_duck_check;
+        if (nb_ceilings > 0 && next_ceiling_check < deadline)
+            deadline = next_ceiling_check;
+        deadline = next_hook_deadline(deadline);
+
+        now = mixoss_time_us();
+        stimeout.tv_sec = 0;
+        stimeout.tv_usec = 0;
+        if (deadline > now) {
+            stimeout.tv_sec = (deadline - now) / 1000000;
+            stimeout.tv_usec = (deadline - now) % 1000000;
+        }
+
+        if (select(max_fd + 1, &readfds, &writefds, NULL, &stimeout) < 0) {
+            if (errno != EINTR)
+                set_ui_error("select() failed: %s", strerror(errno));
+            FD_ZERO(&readfds);
+            FD_ZERO(&writefds);
+        }
+
+        now = mixoss_time_us();
+
+        if (nb_ducks > 0 && now >= next_duck_check)
+            check_ducks(now);
+
+        /* After fades and ducking, which could have raised a level */
+        if (nb_ceilings > 0 && now >= next_ceiling_check)
+            check_ceilings(now);
+
+        if (ramps && now >= next_ramp_tick)
+            run_ramps(now);
+
+        if (now >= next_poll) {
+            next_poll = now + poll_interval * 1000ULL;
+
+            mixoss_refresh(mx);
+            for (int m = 0; m < mx->nb_mixers; m++)
+                mixoss_poll(mx, &mx->mixers[m]);
+        }
+
+        if (FD_ISSET(listen_fd, &readfds))
+            accept_client(listen_fd);
+
+        for (struct client *client = clients; client; client = client->next) {
+            if (FD_ISSET(client->fd, &readfds))
+                read_client(client);
+        }
+
+        /* Changes are coalesced by the poll, a subscriber gets the latest
+         * value once per tick at most. */
+        dispatch_changes();
+
+        pclient = &clients;
+        while (*pclient) {
+            struct client *client = *pclient;
+
+            flush_client(client);
+            if (client->closed) {
+                *pclient = client->next;
+                free_client(client);
+            } else {
+                pclient = &client->next;
+            }
+        }
+    }
+
+    while (clients) {
+        struct client *client = clients;
+
+        clients = client->next;
+        free_client(client);
+    }
+
+    close(listen_fd);
+    unlink(socket_path);
+    return 0;
+}
 
-    curr = cur_mixer->ui_curr_control;
-    prev = NULL;
+static int
+is_watched(const struct mixoss_control *ctrl) {
+    char name[CONTROL_NAME_SIZE];
+
+    if (!mixoss_is_value_control(ctrl))
+        return 0;
+
+    if (nb_cli_ops == 0)
+        return 1;
 
-    if (curr->ui_prev) {
-        prev = curr->ui_prev;
-    } else if (curr->is_vmix) {
-        prev = cur_mixer->ui_dev_controls;
-        while (prev->ui_next)
-            prev = prev->ui_next;
+    mixoss_format_name(ctrl, name, sizeof(name));
+    for (int i = 0; i < nb_cli_ops; i++) {
+        if (strcmp(watch_names[i], name) == 0)
+            return 1;
     }
 
-    if (prev) {
-        cur_mixer->ui_curr_control = prev;
+    return 0;
+}
 
-        curr->needs_redraw = 1;
-        prev->needs_redraw = 1;
-        draw_ui();
+static void
+print_json_string(const char *str) {
+    putchar('"');
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            printf("\\%c", *str);
+        } else if ((unsigned char)*str < 0x20) {
+            printf("\\u%04x", *str);
+        } else {
+            putchar(*str);
+        }
     }
+    putchar('"');
 }
 
 static void
-modify_volume(int sign) {
-    struct control *ctrl;
-    int volume;
-    int inc;
+format_bar_value(const struct mixoss_control *ctrl, char *buf, size_t size) {
+    int left, right;
+
+    mixoss_decode_value(ctrl, ctrl->value, &left, &right);
+
+    switch (ctrl->info.type) {
+        case MIXT_ONOFF:
+        case MIXT_MUTE:
+            snprintf(buf, size, "%s", left ? "on" : "off");
+            break;
+
+        case MIXT_ENUM:
+        case MIXT_VALUE:
+        case MIXT_HEXVALUE:
+            snprintf(buf, size, "%d", left);
+            break;
+
+        default:
+            if (left == right) {
+                snprintf(buf, size, "%d%%", left);
+            } else {
+                snprintf(buf, size, "%d%%/%d%%", left, right);
+            }
+            break;
+    }
+}
 
-    ctrl = cur_mixer->ui_curr_control;
-    inc = sign * (100 / gauge_width);
+static void
+print_watch_event(const struct mixoss_control *ctrl, const char *event) {
+    char name[CONTROL_NAME_SIZE];
+    struct timespec ts;
+    int left, right;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    mixoss_format_name(ctrl, name, sizeof(name));
+
+    printf("{\"time\":%lld,\"event\":\"%s\",\"control\":",
+           (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000, event);
+    print_json_string(name);
+    printf(",\"mixer\":");
+    print_json_string(mx->mixers[ctrl->info.dev].info.name);
+    printf(",\"name\":");
+    print_json_string(ctrl->info.extname[0] ? ctrl->info.extname
+                                            : ctrl->info.id);
+
+    if (mixoss_decode_value(ctrl, ctrl->value, &left, &right) == 2) {
+        printf(",\"values\":[%d,%d]}\n", left, right);
+    } else {
+        printf(",\"values\":[%d]}\n", left);
+    }
+}
 
-    volume = get_control_volume(ctrl);
-    if (volume == -1)
-        return;
+static void
+print_watch_line() {
+    int first;
 
-    volume += inc;
+    /* Status bars redraw the whole line, it is printed in full */
+    if (watch_format == WATCH_I3BAR)
+        putchar('[');
 
-    if (volume < 0) {
-        volume = 0;
-    } else if (volume > 100) {
-        volume = 100;
+    first = 1;
+    for (int m = 0; m < mx->nb_mixers; m++) {
+        struct mixoss_mixer *mixer = &mx->mixers[m];
+
+        for (int c = 0; c < mixer->nb_controls; c++) {
+            struct mixoss_control *ctrl = &mixer->controls[c];
+            char name[CONTROL_NAME_SIZE];
+            char text[64];
+            char value[32];
+
+            if (!is_watched(ctrl))
+                continue;
+
+            format_bar_value(ctrl, value, sizeof(value));
+            snprintf(text, sizeof(text), "%s %s",
+                     ctrl->info.extname[0] ? ctrl->info.extname
+                                           : ctrl->info.id, value);
+
+            if (watch_format == WATCH_I3BAR) {
+                mixoss_format_name(ctrl, name, sizeof(name));
+                printf("%s{\"name\":", first ? "" : ",");
+                print_json_string(name);
+                printf(",\"full_text\":");
+                print_json_string(text);
+                putchar('}');
+            } else {
+                printf("%s%s", first ? "" : " ", text);
+            }
+            first = 0;
+        }
     }
 
-    set_control_volume(ctrl, volume);
+    fputs(watch_format == WATCH_I3BAR ? "],\n" : "\n", stdout);
 }
 
 static void
-set_volume(int volume) {
-    struct control *ctrl;
+print_watch_changes(int snapshot) {
+    int changed;
 
-    ctrl = cur_mixer->ui_curr_control;
+    changed = snapshot;
+    for (int m = 0; m < mx->nb_mixers; m++) {
+        struct mixoss_mixer *mixer = &mx->mixers[m];
 
-    if (volume < 0) {
-        volume = 0;
-    } else if (volume > 100) {
-        volume = 100;
+        for (int c = 0; c < mixer->nb_controls; c++) {
+            struct mixoss_control *ctrl = &mixer->controls[c];
+
+            if (!is_watched(ctrl) || !(snapshot || ctrl->changed))
+                continue;
+
+            changed = 1;
+            if (watch_format == WATCH_JSON)
+                print_watch_event(ctrl, snapshot ? "snapshot" : "change");
+        }
     }
 
-    set_control_volume(ctrl, volume);
+    if (changed && watch_format != WATCH_JSON)
+        print_watch_line();
+
+    fflush(stdout);
 }
 
-int
-main(int argc, char **argv) {
-    int modify_counter;
-    int stop;
-    int opt;
+static int
+run_watch() {
+    unsigned long long next_poll, next_print;
+    int pending;
+
+    /* Controls given with -g restrict the watch, they are only checked
+     * once since names survive mixer reloads */
+    watch_names = calloc(nb_cli_ops, sizeof(*watch_names));
+    if (nb_cli_ops > 0 && !watch_names) {
+        perror("cannot allocate control names");
+        return 1;
+    }
 
-    while ((opt = getopt(argc, argv, "h")) != -1) {
-        switch (opt) {
-            case 'h':
-                printf("usage: %s [-h]", argv[0]);
-                exit(0);
+    for (int i = 0; i < nb_cli_ops; i++) {
+        struct mixoss_control *ctrl;
 
-            default:
-                fprintf(stderr, "unknown option: -%c\n", opt);
-                exit(1);
+        ctrl = mixoss_lookup(mx, cli_ops[i].name);
+        if (!ctrl || !mixoss_is_value_control(ctrl)) {
+            fprintf(stderr, "unknown control '%s'\n", cli_ops[i].name);
+            free(watch_names);
+            return 1;
         }
+        mixoss_format_name(ctrl, watch_names[i], sizeof(*watch_names));
     }
 
-    if ((mixer_fd = open(mixer_dev, O_RDWR)) < 0) {
-        perror("cannot open mixer");
-        exit(1);
+    catch_quit_signals();
+
+    for (int m = 0; m < mx->nb_mixers; m++)
+        mixoss_poll(mx, &mx->mixers[m]);
+
+    if (watch_format == WATCH_I3BAR)
+        printf("{\"version\":1}\n[\n");
+    print_watch_changes(1);
+    dispatch_changes();
+
+    next_poll = mixoss_time_us() + poll_interval * 1000ULL;
+    next_print = 0;
+    pending = 0;
+
+    while (!quit_requested && !ferror(stdout)) {
+        unsigned long long now, deadline;
+        struct timespec ts;
+
+        deadline = next_poll;
+        if (pending && next_print < deadline)
+            deadline = next_print;
+        deadline = next_hook_deadline(deadline);
+
+        now = mixoss_time_us();
+        if (deadline > now) {
+            ts.tv_sec = (deadline - now) / 1000000;
+            ts.tv_nsec = (deadline - now) % 1000000 * 1000;
+            nanosleep(&ts, NULL);
+            continue;
+        }
+
+        if (now >= next_poll) {
+            next_poll = now + poll_interval * 1000ULL;
+
+            mixoss_refresh(mx);
+            for (int m = 0; m < mx->nb_mixers; m++)
+                mixoss_poll(mx, &mx->mixers[m]);
+
+            /* A reload changes the controls themselves */
+            if (mx->reloaded)
+                pending = 1;
+
+            for (int m = 0; m < mx->nb_mixers && !pending; m++) {
+                for (int c = 0; c < mx->mixers[m].nb_controls; c++) {
+                    if (mx->mixers[m].controls[c].changed) {
+                        pending = 1;
+                        break;
+                    }
+                }
+            }
+
+            /* Health and error counters are not held by the window, the
+             * metrics are only rewritten when they moved */
+            if (export_path && !pending)
+                export_metrics(0);
+        }
+
+        /* Changes are held until watch_window passed since the previous
+         * output: a single change goes out at once, a burst (e.g. a fade)
+         * as one output per window. */
+        if (pending && now >= next_print) {
+            print_watch_changes(0);
+            dispatch_changes();
+            next_print = now + watch_window * 1000ULL;
+            pending = 0;
+        }
+
+        /* Hooks fire at the end of their own window, whatever the output
+         * is waiting for */
+        if (nb_hooks > 0)
+            run_hooks(now);
     }
 
-    if (load_mixers() < 0)
-        exit(1);
-    cur_mixer = &mixers[0];
+    free(watch_names);
+    return ferror(stdout) ? 1 : 0;
+}
+
+static int
+run_ui() {
+    unsigned long long next_poll;
+    int key_prefix;
+    int stop;
+
+    cur_dev = 0;
+
+    /* Loaded before curses takes the terminal, so that errors show */
+    if (groups_path && load_groups(groups_path) == -1)
+        return 1;
+
+    if (fifo_path && open_fifo() == -1) {
+        free_groups();
+        return 1;
+    }
 
     if (init_ui() < 0) {
-        free_mixers();
-        exit(1);
+        free_groups();
+        close_fifo();
+        return 1;
+    }
+
+    if (needs_all_values()) {
+        for (int m = 0; m < mx->nb_mixers; m++)
+            mixoss_poll(mx, &mx->mixers[m]);
+    } else {
+        mixoss_poll(mx, &mx->mixers[cur_dev]);
     }
+    dispatch_changes();
 
     clear();
     draw_ui();
 
-    modify_counter = -1;
+    key_prefix = 0;
+    next_poll = mixoss_time_us() + poll_interval * 1000ULL;
 
     stop = 0;
     while (!stop) {
+        unsigned long long now, deadline;
         fd_set readfds;
         struct timeval stimeout;
+        int max_fd;
 
         FD_ZERO(&readfds);
         FD_SET(STDIN_FILENO, &readfds);
+        max_fd = STDIN_FILENO;
+        if (fifo_fd >= 0) {
+            FD_SET(fifo_fd, &readfds);
+            if (fifo_fd > max_fd)
+                max_fd = fifo_fd;
+        }
 
-        stimeout.tv_sec = poll_interval / 1000;
-        stimeout.tv_usec = (poll_interval % 1000) * 1000;
+        /* Fades, ducking and ceilings run on their own, faster, ticks */
+        deadline = next_poll;
+        if (ramps && next_ramp_tick < deadline)
+            deadline = next_ramp_tick;
+        if (nb_ducks > 0 && next_duck_check < deadline)
+            deadline = next_duck_check;
+        if (nb_ceilings > 0 && next_ceiling_check < deadline)
+            deadline = next_ceiling_check;
+        deadline = next_hook_deadline(deadline);
+
+        now = mixoss_time_us();
+        stimeout.tv_sec = 0;
+        stimeout.tv_usec = 0;
+        if (deadline > now) {
+            stimeout.tv_sec = (deadline - now) / 1000000;
+            stimeout.tv_usec = (deadline - now) % 1000000;
+        }
 
-        if (select(1, &readfds, NULL, NULL, &stimeout) < 0) {
+        if (select(max_fd + 1, &readfds, NULL, NULL, &stimeout) < 0) {
             if (errno == EINTR)
                 continue;
 
             set_ui_error("select() failed: %s", strerror(errno));
+            FD_ZERO(&readfds);
         }
 
-        for (int c = 0; c < cur_mixer->nb_controls; c++)
-            cur_mixer->controls[c].needs_redraw = 1;
-        draw_ui();
+        now = mixoss_time_us();
+
+        if (nb_ducks > 0 && now >= next_duck_check)
+            check_ducks(now);
+
+        /* After fades and ducking, which could have raised a level */
+        if (nb_ceilings > 0 && now >= next_ceiling_check)
+            check_ceilings(now);
+
+        if (ramps && now >= next_ramp_tick) {
+            run_ramps(now);
+            draw_ui();
+        }
+
+        if (now >= next_poll) {
+            next_poll = now + poll_interval * 1000ULL;
+
+            /* A reload shows up as a new generation of the mixer, which
+             * draw_ui() picks up */
+            mixoss_refresh(mx);
+            sync_ui_mixer(&mx->mixers[cur_dev]);
+
+            /* Mirrors follow their sources within a tick, see
+             * needs_all_values() for the others */
+            if (needs_all_values()) {
+                for (int m = 0; m < mx->nb_mixers; m++)
+                    mixoss_poll(mx, &mx->mixers[m]);
+            } else {
+                mixoss_poll(mx, &mx->mixers[cur_dev]);
+            }
+
+            /* vmix labels follow the applications using the channels */
+            refresh_owners(&mx->mixers[cur_dev]);
+            draw_ui();
+        }
+
+        if (fifo_fd >= 0 && FD_ISSET(fifo_fd, &readfds))
+            read_fifo();
 
         if (FD_ISSET(STDIN_FILENO, &readfds)) {
             int c;
 
-            switch (c = getch()) {
+            c = getch();
+
+            /* Everything typed goes to the search until it ends */
+            if (searching) {
+                handle_search_key(c);
+                continue;
+            }
+
+            /* m<n> saves the current values in scene n, '<n> recalls it */
+            if (key_prefix) {
+                if (c >= '0' && c < '0' + NB_SCENES) {
+                    if (key_prefix == 'm') {
+                        capture_scene(c - '0');
+                    } else {
+                        recall_scene(c - '0');
+                    }
+                }
+
+                key_prefix = 0;
+                continue;
+            }
+
+            switch (c) {
                 case 'q':
                     stop = 1;
                     break;
 
+                case 's':
+                    toggle_stats();
+                    break;
+
+                case 'g':
+                    toggle_groups();
+                    break;
+
+                case 'c':
+                    toggle_collapse();
+                    break;
+
+                case '/':
+                    start_search();
+                    break;
+
+                case 'm':
+                case '\'':
+                    key_prefix = c;
+                    break;
+
                 case 'j':
                     move_to_next_control();
                     break;
@@ -608,11 +5111,422 @@ main(int argc, char **argv) {
                     break;
             }
         }
+
+        dispatch_changes();
     }
 
     free_ui();
-    free_mixers();
-    close(mixer_fd);
+    free_groups();
+    close_fifo();
+
+    for (int i = 0; i < NB_SCENES; i++)
+        free(scenes[i].values);
+
+    return 0;
+}
+
+static int
+parse_int_option(const char *name, const char *arg, int min) {
+    char *end;
+    long value;
+
+    /* Intervals of 0 would make the loops spin */
+    value = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || value < min || value > INT_MAX) {
+        fprintf(stderr, "invalid %s%s '%s', at least %d expected\n",
+                name[1] ? "--" : "-", name, arg, min);
+        exit(1);
+    }
+
+    return value;
+}
+
+static int
+load_state() {
+    if (mixoss_load(mx) == -1)
+        return -1;
+
+    /* Mirrors refer to controls, which must exist by now */
+    if (mirrors_path && load_mirrors(mirrors_path) == -1)
+        return -1;
+
+    if (ducks_path && load_ducks(ducks_path) == -1)
+        return -1;
+
+    if (ceilings_path && load_ceilings(ceilings_path) == -1)
+        return -1;
+
+    if (hooks_path && load_hooks(hooks_path) == -1)
+        return -1;
 
     return 0;
 }
+
+int
+main(int argc, char **argv) {
+    enum {
+        OPT_STATS = 256,
+        OPT_RECORD,
+        OPT_REPLAY,
+        OPT_REPLAY_SCALE,
+        OPT_MAP,
+        OPT_STORE,
+        OPT_RESTORE,
+        OPT_DAEMON,
+        OPT_ATTACH,
+        OPT_SOCKET,
+        OPT_PUBLISH,
+        OPT_SHM,
+        OPT_PEEK,
+        OPT_WATCH,
+        OPT_WATCH_WINDOW,
+        OPT_EXPORT,
+        OPT_GROUPS,
+        OPT_MIRROR,
+        OPT_DUCK,
+        OPT_DUCK_INTERVAL,
+        OPT_CEILING,
+        OPT_CEILING_INTERVAL,
+        OPT_FIFO,
+        OPT_HOOKS,
+        OPT_HOOK_WINDOW,
+        OPT_HOOK_JOBS,
+        OPT_JOURNAL,
+        OPT_JOURNAL_FLUSH,
+        OPT_JOURNAL_SYNC,
+    };
+
+    static const struct option long_opts[] = {
+        {"help",         no_argument,       NULL, 'h'},
+        {"fade",         required_argument, NULL, 'f'},
+        {"stats",        no_argument,       NULL, OPT_STATS},
+        {"record",       required_argument, NULL, OPT_RECORD},
+        {"replay",       required_argument, NULL, OPT_REPLAY},
+        {"replay-scale", required_argument, NULL, OPT_REPLAY_SCALE},
+        {"map",          required_argument, NULL, OPT_MAP},
+        {"store",        required_argument, NULL, OPT_STORE},
+        {"restore",      required_argument, NULL, OPT_RESTORE},
+        {"daemon",       no_argument,       NULL, OPT_DAEMON},
+        {"attach",       no_argument,       NULL, OPT_ATTACH},
+        {"socket",       required_argument, NULL, OPT_SOCKET},
+        {"publish",      no_argument,       NULL, OPT_PUBLISH},
+        {"shm",          required_argument, NULL, OPT_SHM},
+        {"peek",         required_argument, NULL, OPT_PEEK},
+        {"watch",        required_argument, NULL, OPT_WATCH},
+        {"watch-window", required_argument, NULL, OPT_WATCH_WINDOW},
+        {"export",       required_argument, NULL, OPT_EXPORT},
+        {"groups",       required_argument, NULL, OPT_GROUPS},
+        {"mirror",       required_argument, NULL, OPT_MIRROR},
+        {"duck",         required_argument, NULL, OPT_DUCK},
+        {"duck-interval", required_argument, NULL, OPT_DUCK_INTERVAL},
+        {"ceiling",      required_argument, NULL, OPT_CEILING},
+        {"ceiling-interval", required_argument, NULL, OPT_CEILING_INTERVAL},
+        {"fifo",         required_argument, NULL, OPT_FIFO},
+        {"hooks",        required_argument, NULL, OPT_HOOKS},
+        {"hook-window",  required_argument, NULL, OPT_HOOK_WINDOW},
+        {"hook-jobs",    required_argument, NULL, OPT_HOOK_JOBS},
+        {"journal",      required_argument, NULL, OPT_JOURNAL},
+        {"journal-flush", required_argument, NULL, OPT_JOURNAL_FLUSH},
+        {"journal-sync", required_argument, NULL, OPT_JOURNAL_SYNC},
+        {NULL, 0, NULL, 0}
+    };
+
+    const char *record_path, *replay_path;
+    const char *store_path, *restore_path;
+    int daemon_mode, attach_mode;
+    int publish;
+    const char **peek_names;
+    int nb_peek_names;
+    int status;
+    int opt;
+
+    record_path = NULL;
+    replay_path = NULL;
+    store_path = NULL;
+    restore_path = NULL;
+    daemon_mode = 0;
+    attach_mode = 0;
+    publish = 0;
+    nb_peek_names = 0;
+
+    mx = mixoss_new();
+    if (!mx) {
+        perror("cannot create mixer context");
+        exit(1);
+    }
+    mixoss_set_error_handler(mx, report_error, NULL);
+
+    cli_ops = calloc(argc, sizeof(struct cli_op));
+    if (!cli_ops) {
+        perror("cannot allocate operations");
+        exit(1);
+    }
+
+    peek_names = calloc(argc, sizeof(const char *));
+    if (!peek_names) {
+        perror("cannot allocate operations");
+        exit(1);
+    }
+
+    while ((opt = getopt_long(argc, argv, "hs:g:f:", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'h':
+                printf("usage: %s [-h] [-s <control>=<value>[,<value>]]"
+                       " [-g <control>] [-f <ms>] [--map <file>]"
+                       " [--store <file>]"
+                       " [--restore <file>] [--stats] [--record <file>]"
+                       " [--replay <file>] [--replay-scale <factor>]"
+                       " [--daemon] [--attach] [--socket <path>]"
+                       " [--publish] [--shm <path>] [--peek <control>]"
+                       " [--watch json|i3bar|text] [--watch-window <ms>]"
+                       " [--export <file>] [--groups <file>]"
+                       " [--mirror <file>] [--duck <file>]"
+                       " [--duck-interval <ms>] [--ceiling <file>]"
+                       " [--ceiling-interval <ms>] [--fifo <path>]"
+                       " [--hooks <file>] [--hook-window <ms>]"
+                       " [--hook-jobs <n>] [--journal <file>]"
+                       " [--journal-flush <ms>] [--journal-sync <ms>]",
+                       argv[0]);
+                exit(0);
+
+            case 's': {
+                char *sep;
+
+                sep = strchr(optarg, '=');
+                if (!sep) {
+                    fprintf(stderr, "invalid setting '%s'\n", optarg);
+                    exit(1);
+                }
+                *sep = '\0';
+
+                cli_ops[nb_cli_ops].name = optarg;
+                cli_ops[nb_cli_ops].values = sep + 1;
+                nb_cli_ops++;
+                break;
+            }
+
+            case 'g':
+                cli_ops[nb_cli_ops].name = optarg;
+                nb_cli_ops++;
+                break;
+
+            case 'f':
+                fade_duration = parse_int_option("f", optarg, 0);
+                break;
+
+            case OPT_STATS:
+                mixoss_enable_stats(mx);
+                stats_dump = 1;
+                break;
+
+            case OPT_RECORD:
+                record_path = optarg;
+                break;
+
+            case OPT_REPLAY:
+                replay_path = optarg;
+                break;
+
+            case OPT_REPLAY_SCALE:
+                /* 0 replays without any delay */
+                replay_scale = strtod(optarg, NULL);
+                break;
+
+            case OPT_MAP:
+                map_path = optarg;
+                break;
+
+            case OPT_STORE:
+                store_path = optarg;
+                break;
+
+            case OPT_RESTORE:
+                restore_path = optarg;
+                break;
+
+            case OPT_DAEMON:
+                daemon_mode = 1;
+                break;
+
+            case OPT_ATTACH:
+                attach_mode = 1;
+                break;
+
+            case OPT_SOCKET:
+                socket_path = optarg;
+                break;
+
+            case OPT_PUBLISH:
+                publish = 1;
+                break;
+
+            case OPT_SHM:
+                shm_path = optarg;
+                break;
+
+            case OPT_PEEK:
+                peek_names[nb_peek_names++] = optarg;
+                break;
+
+            case OPT_WATCH:
+                if (strcmp(optarg, "json") == 0) {
+                    watch_format = WATCH_JSON;
+                } else if (strcmp(optarg, "i3bar") == 0) {
+                    watch_format = WATCH_I3BAR;
+                } else if (strcmp(optarg, "text") == 0) {
+                    watch_format = WATCH_TEXT;
+                } else {
+                    fprintf(stderr, "unknown watch format '%s'\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case OPT_WATCH_WINDOW:
+                watch_window = parse_int_option("watch-window", optarg, 0);
+                break;
+
+            case OPT_EXPORT:
+                /* Error counters come from the ioctl stats */
+                export_path = optarg;
+                mixoss_enable_stats(mx);
+                break;
+
+            case OPT_GROUPS:
+                groups_path = optarg;
+                break;
+
+            case OPT_MIRROR:
+                mirrors_path = optarg;
+                break;
+
+            case OPT_DUCK:
+                ducks_path = optarg;
+                break;
+
+            case OPT_DUCK_INTERVAL:
+                duck_interval = parse_int_option("duck-interval", optarg, 1);
+                break;
+
+            case OPT_CEILING:
+                ceilings_path = optarg;
+                break;
+
+            case OPT_CEILING_INTERVAL:
+                ceiling_interval = parse_int_option("ceiling-interval",
+                                                    optarg, 1);
+                break;
+
+            case OPT_FIFO:
+                fifo_path = optarg;
+                break;
+
+            case OPT_HOOKS:
+                hooks_path = optarg;
+                break;
+
+            case OPT_HOOK_WINDOW:
+                hook_window = parse_int_option("hook-window", optarg, 1);
+                break;
+
+            case OPT_HOOK_JOBS:
+                max_hook_jobs = parse_int_option("hook-jobs", optarg, 1);
+                break;
+
+            case OPT_JOURNAL:
+                journal_path = optarg;
+                break;
+
+            case OPT_JOURNAL_FLUSH:
+                journal_flush_interval = parse_int_option("journal-flush",
+                                                          optarg, 1);
+                break;
+
+            case OPT_JOURNAL_SYNC:
+                journal_sync_interval = parse_int_option("journal-sync",
+                                                         optarg, 0);
+                break;
+
+            default:
+                fprintf(stderr, "unknown option: -%c\n", opt);
+                exit(1);
+        }
+    }
+
+    /* Ducking and ceilings are enforced by the loops of the daemon and of
+     * the UI only */
+    if ((ducks_path || ceilings_path)
+     && (nb_peek_names > 0 || store_path || restore_path
+      || (!daemon_mode && (watch_format != WATCH_NONE || nb_cli_ops > 0
+                           || export_path)))) {
+        fprintf(stderr, "--duck and --ceiling need --daemon or the UI\n");
+        exit(1);
+    }
+
+    /* Readers of the published state never touch the device */
+    if (nb_peek_names > 0) {
+        status = run_peek(peek_names, nb_peek_names);
+        free(peek_names);
+        free(cli_ops);
+        mixoss_free(mx);
+        return status;
+    }
+
+    /* Backoff of failing mixers starts at the poll rate */
+    mx->retry_interval = poll_interval;
+
+    if (replay_path) {
+        if (mixoss_open_replay(mx, replay_path, replay_scale) < 0)
+            exit(1);
+    } else if (attach_mode) {
+        /* Every ioctl goes through the daemon */
+        if (connect_daemon() == -1)
+            exit(1);
+    } else if (mixoss_open(mx, mixer_dev) < 0) {
+        perror("cannot open mixer");
+        exit(1);
+    }
+
+    if (record_path && mixoss_record(mx, record_path) < 0) {
+        fprintf(stderr, "cannot open %s: %s\n", record_path, strerror(errno));
+        exit(1);
+    }
+
+    if (publish && open_shm(64) == -1)
+        exit(1);
+
+    if (journal_path && open_journal() == -1)
+        exit(1);
+
+    if (store_path) {
+        status = mixoss_load(mx) == -1 ? 1 : run_store(store_path);
+    } else if (restore_path) {
+        status = mixoss_load(mx) == -1 ? 1 : run_restore(restore_path);
+    } else if (daemon_mode) {
+        status = load_state() == -1 ? 1 : run_daemon();
+    } else if (watch_format != WATCH_NONE) {
+        status = load_state() == -1 ? 1 : run_watch();
+    } else if (nb_cli_ops > 0) {
+        status = run_cli();
+    } else if (export_path) {
+        status = load_state() == -1 ? 1 : run_export();
+    } else {
+        status = load_state() == -1 ? 1 : run_ui();
+    }
+
+    if (stats_dump)
+        dump_stats();
+
+    close_shm();
+    close_journal();
+    mixoss_free(mx);
+    free(exported_health);
+    free(mirrors);
+    free(ducks);
+    free(engines);
+    free(ceilings);
+    free_hooks();
+    free(cli_ops);
+    free(peek_names);
+
+    return status;
+}
@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2010 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MIXOSS_H
+#define MIXOSS_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include <soundcard.h>
+
+/*
+ * libmixoss: enumeration, lookup, values and change polling of the OSS
+ * mixers, without any user interface.
+ *
+ * Everything hangs off a context, struct mixoss. Every function taking a
+ * context locks it, so one context can be shared between threads. Mixers
+ * and controls are owned by the context. Control pointers stay valid
+ * until a mixoss_refresh() reloads their mixer, which bumps the
+ * generation of the mixer. Mixers live in a single array which grows
+ * when a device shows up: any mixoss_refresh() may move it, so mixers are
+ * kept by index, never by pointer, across a refresh. Fields of the
+ * structures may be read directly by single threaded callers, other
+ * callers hold mixoss_lock() while doing so.
+ *
+ * The lock is recursive: a caller sharing the context between threads
+ * holds mixoss_lock() from the lookup of a control to its last use, e.g.
+ * around mixoss_lookup() and mixoss_read(), so that no other thread
+ * reloads the mixer in between. Error messages are passed to the error
+ * handler once the outermost lock is released, the handler may then call
+ * any function.
+ */
+
+enum mixoss_op {
+    MIXOSS_OP_NRMIX,
+    MIXOSS_OP_MIXERINFO,
+    MIXOSS_OP_EXTINFO,
+    MIXOSS_OP_READ,
+    MIXOSS_OP_WRITE,
+    MIXOSS_OP_ENGINEINFO,
+
+    MIXOSS_NB_OPS
+};
+
+/* Latency histograms use log2 buckets: bucket b counts calls which took
+ * less than 2^b microseconds, the last bucket is open-ended. */
+#define MIXOSS_NB_STAT_BUCKETS 20
+
+struct mixoss_op_stats {
+    unsigned long count;
+    unsigned long errors;
+    unsigned long long total_us;
+    unsigned long long max_us;
+    unsigned long buckets[MIXOSS_NB_STAT_BUCKETS];
+};
+
+/* Large enough for the hexadecimal dump of any ioctl argument */
+#define MIXOSS_HEX_ARG_SIZE (2 * sizeof(struct oss_audioinfo) + 2)
+
+/* Large enough for any line of the daemon protocol */
+#define MIXOSS_LINE_SIZE (MIXOSS_HEX_ARG_SIZE + 64)
+
+struct mixoss_control {
+    struct oss_mixext info;
+    int is_vmix;
+    int vmix_dev;
+    int ambiguous; /* another control of the mixer has the same id */
+
+    /* MIXOSS_NB_OPS entries, only allocated once stats are enabled */
+    struct mixoss_op_stats *stats;
+
+    int value; /* raw value, as last read or written */
+    int changed; /* value changed, cleared by the caller */
+    int has_value; /* value was read or written at least once */
+    int no_poll; /* left out by mixoss_poll(), see mixoss_set_polled() */
+
+    int pending;
+    int pending_value;
+    int write_error; /* errno of the last flushed write, 0 on success */
+    struct mixoss_control *pending_next;
+};
+
+enum mixoss_health {
+    MIXOSS_OK,
+    MIXOSS_DEGRADED, /* ioctls fail, retried with an exponential backoff */
+    MIXOSS_GONE,     /* device missing or disabled, probed at max_backoff */
+};
+
+struct mixoss_mixer {
+    struct oss_mixerinfo info;
+
+    struct mixoss_control *controls;
+    int nb_controls;
+    unsigned int generation; /* bumped whenever controls are reloaded */
+
+    struct mixoss_control *pending_controls;
+
+    int values_counter; /* modify_counter when values were last read */
+
+    int needs_reload;
+
+    enum mixoss_health health;
+    int nb_failures;
+    int backoff; /* ms */
+    unsigned long long retry_at; /* us, no ioctl is issued before */
+};
+
+/* Error messages queued until the context is unlocked */
+#define MIXOSS_NB_REPORTS 8
+#define MIXOSS_REPORT_SIZE 256
+
+#define MIXOSS_SHM_MAGIC 0x534f584d /* "MXOS" */
+#define MIXOSS_SHM_VERSION 2
+
+/* Orders the seqlock counter against the data, for the compiler and the
+ * CPU */
+#define mixoss_memory_barrier() __sync_synchronize()
+
+/* Control published in the shared state */
+struct mixoss_shm_control {
+    int dev;
+    int ctrl;
+    int ambiguous; /* named by index, see mixoss_format_name() */
+    char id[16];
+    char extname[32];
+    int value; /* raw */
+    int nb_channels;
+    int left, right; /* % for sliders, raw otherwise */
+};
+
+/* Shared state published by mixoss --publish, a file mapped by the
+ * readers.
+ *
+ * seq is odd while the writer updates the controls: a reader copies what it
+ * needs between two reads of an even and identical seq. The segment is
+ * replaced when it grows, obsolete then tells readers to map it again. */
+struct mixoss_shm_header {
+    unsigned int magic;
+    unsigned int version;
+    volatile unsigned int seq;
+    volatile unsigned int obsolete;
+    unsigned int capacity;
+    unsigned int nb_controls;
+    struct mixoss_shm_control controls[];
+};
+
+/* A mapping of the shared state, which does not need a context */
+struct mixoss_shm_reader {
+    char path[1024];
+    const struct mixoss_shm_header *hdr;
+    size_t size;
+};
+
+struct mixoss_replay;
+
+struct mixoss {
+    pthread_mutex_t lock;
+    int lock_depth;
+
+    int fd; /* -1 when replaying or attached to a daemon */
+
+    struct mixoss_mixer *mixers;
+    int nb_mixers;
+    int reloaded; /* a mixer was (re)loaded, cleared by the caller */
+
+    int retry_interval; /* ms, first backoff of a failing mixer */
+    int max_backoff; /* ms */
+    int max_failures;
+
+    int stats_enabled;
+    struct mixoss_op_stats op_stats[MIXOSS_NB_OPS];
+
+    FILE *record_fp;
+    unsigned long long record_start;
+
+    struct mixoss_replay *replay;
+
+    int remote_fd;
+    char remote_in[MIXOSS_LINE_SIZE];
+    size_t remote_in_len;
+
+    void (*error_handler)(void *, const char *);
+    void *error_data;
+
+    /* Called for every change of a value, see mixoss_set_change_handler() */
+    void (*change_handler)(void *, const struct mixoss_control *, int, int);
+    void *change_data;
+
+    char reports[MIXOSS_NB_REPORTS][MIXOSS_REPORT_SIZE];
+    int nb_reports;
+};
+
+extern const char *mixoss_op_names[MIXOSS_NB_OPS];
+extern const size_t mixoss_op_arg_sizes[MIXOSS_NB_OPS];
+extern const char *mixoss_health_names[];
+
+/* Context */
+struct mixoss *mixoss_new();
+void mixoss_free(struct mixoss *);
+void mixoss_lock(struct mixoss *);
+void mixoss_unlock(struct mixoss *);
+void mixoss_set_error_handler(struct mixoss *,
+                              void (*)(void *, const char *), void *);
+
+/* The handler gets the control, its previous value, and whether the
+ * change was a write of the caller rather than an outside one. It is
+ * called with the context locked and must return quickly. */
+void mixoss_set_change_handler(struct mixoss *,
+                               void (*)(void *, const struct mixoss_control *,
+                                        int, int),
+                               void *);
+
+/* Backends, exactly one of them is used */
+int mixoss_open(struct mixoss *, const char *);
+int mixoss_open_replay(struct mixoss *, const char *, double);
+int mixoss_connect(struct mixoss *, const char *);
+
+int mixoss_record(struct mixoss *, const char *);
+void mixoss_enable_stats(struct mixoss *);
+
+/* Enumeration and polling */
+int mixoss_load(struct mixoss *);
+int mixoss_load_infos(struct mixoss *);
+int mixoss_init_mixers(struct mixoss *, int);
+int mixoss_load_mixer(struct mixoss *, struct mixoss_mixer *);
+void mixoss_refresh(struct mixoss *);
+void mixoss_poll(struct mixoss *, struct mixoss_mixer *);
+void mixoss_set_polled(struct mixoss *, struct mixoss_control *, int);
+void mixoss_free_mixers(struct mixoss *);
+
+/* Lookup. Controls are named [mixer:]id or [mixer:]#index. An id shared
+ * by several controls of a mixer is refused with EEXIST, and
+ * mixoss_format_name() names these controls by index. */
+struct mixoss_mixer *mixoss_find_mixer(struct mixoss *, const char *, size_t);
+struct mixoss_control *mixoss_find_control(struct mixoss *,
+                                           struct mixoss_mixer *,
+                                           const char *);
+struct mixoss_mixer *mixoss_find_control_mixer(struct mixoss *, const char *,
+                                               const char **);
+struct mixoss_control *mixoss_lookup(struct mixoss *, const char *);
+struct mixoss_control *mixoss_get_control(struct mixoss *, int, int);
+
+/* Values */
+int mixoss_read(struct mixoss *, struct mixoss_control *);
+int mixoss_write(struct mixoss *, struct mixoss_control *, int);
+void mixoss_queue_write(struct mixoss *, struct mixoss_control *, int);
+int mixoss_flush(struct mixoss *);
+int mixoss_ioctl(struct mixoss *, enum mixoss_op, struct mixoss_control *,
+                 unsigned long, void *);
+int mixoss_raw_ioctl(struct mixoss *, enum mixoss_op, struct mixoss_control *,
+                     unsigned long, void *);
+
+/* Helpers, which do not need a context */
+int mixoss_decode_value(const struct mixoss_control *, int, int *, int *);
+int mixoss_encode_value(const struct mixoss_control *, int, int);
+int mixoss_is_value_control(const struct mixoss_control *);
+int mixoss_parse_levels(const char *, int *, int *);
+int mixoss_parse_value(const struct mixoss_control *, const char *,
+                       int *, int *);
+void mixoss_format_value(const struct mixoss_control *, char *, size_t);
+void mixoss_format_name(const struct mixoss_control *, char *, size_t);
+void mixoss_encode_hex(char *, const void *, size_t);
+void mixoss_decode_hex(const char *, void *, size_t);
+void mixoss_runtime_path(char *, size_t, const char *);
+void mixoss_set_cloexec(int);
+unsigned long long mixoss_time_us();
+
+/* Shared state readers. mixoss_shm_read() maps the segment again when the
+ * writer replaced it, and fails with EAGAIN when no consistent copy could
+ * be made in time, e.g. the writer died in the middle of an update, with
+ * ESTALE when the replaced segment cannot be mapped, with ENOENT for an
+ * unknown control, or with EEXIST for an ambiguous one. */
+int mixoss_shm_open(struct mixoss_shm_reader *, const char *);
+void mixoss_shm_close(struct mixoss_shm_reader *);
+int mixoss_shm_read(struct mixoss_shm_reader *, const char *,
+                    struct mixoss_shm_control *);
+
+#endif